@@ -0,0 +1,320 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "background-cache.h"
+#include "log.h"
+
+#define CACHE_MAGIC "SWLKBG\0\3"
+// Oldest entries are evicted once the cache grows beyond this
+#define CACHE_MAX_SIZE (512LL * 1024 * 1024)
+// Pixel data starts page aligned, so that reading it into a buffer copies
+// whole pages
+#define CACHE_DATA_ALIGN 4096
+
+struct cache_header {
+	char magic[8];
+	uint32_t key_len;
+	uint32_t width, height, stride;
+	uint32_t data_offset;
+	// Pixels known to be opaque
+	int32_t opaque_x, opaque_y, opaque_width, opaque_height;
+};
+
+static char *get_cache_dir(void) {
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	const char *suffix = "";
+	if (!cache_home || cache_home[0] == '\0') {
+		if (!home || home[0] == '\0') {
+			return NULL;
+		}
+		cache_home = home;
+		suffix = "/.cache";
+	}
+
+	size_t len = strlen(cache_home) + strlen(suffix) + strlen("/swaylock") + 1;
+	char *dir = malloc(len);
+	if (!dir) {
+		return NULL;
+	}
+	snprintf(dir, len, "%s%s", cache_home, suffix);
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+		free(dir);
+		return NULL;
+	}
+	strcat(dir, "/swaylock");
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+		swaylock_log_errno(LOG_DEBUG, "Unable to create cache directory %s",
+				dir);
+		free(dir);
+		return NULL;
+	}
+	return dir;
+}
+
+static uint64_t hash_key(const char *key) {
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (const char *c = key; *c; ++c) {
+		hash ^= (unsigned char)*c;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static char *get_entry_path(const char *dir, const char *key) {
+	size_t len = strlen(dir) + 1 + 16 + 1;
+	char *path = malloc(len);
+	if (path) {
+		snprintf(path, len, "%s/%016llx", dir,
+				(unsigned long long)hash_key(key));
+	}
+	return path;
+}
+
+char *background_cache_key(const char *path, int width, int height,
+		int transform, enum background_mode mode, uint32_t color,
+		enum image_filter filter, enum image_filter limit) {
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		return NULL;
+	}
+	const char *format = "%s\n%lld.%09ld %lld\n%dx%d %d %d %08x %d %d";
+	int len = snprintf(NULL, 0, format, path,
+			(long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+			(long long)st.st_size, width, height, transform, (int)mode,
+			color, (int)filter, (int)limit);
+	char *key = malloc(len + 1);
+	if (key) {
+		snprintf(key, len + 1, format, path,
+				(long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+				(long long)st.st_size, width, height, transform, (int)mode,
+				color, (int)filter, (int)limit);
+	}
+	return key;
+}
+
+static bool pread_full(int fd, void *buf, size_t size, off_t offset) {
+	while (size > 0) {
+		ssize_t amt = pread(fd, buf, size, offset);
+		if (amt <= 0) {
+			return false;
+		}
+		buf = (char *)buf + amt;
+		size -= amt;
+		offset += amt;
+	}
+	return true;
+}
+
+static bool pwrite_full(int fd, const void *buf, size_t size, off_t offset) {
+	while (size > 0) {
+		ssize_t amt = pwrite(fd, buf, size, offset);
+		if (amt <= 0) {
+			return false;
+		}
+		buf = (const char *)buf + amt;
+		size -= amt;
+		offset += amt;
+	}
+	return true;
+}
+
+// Opens the entry for the key if it holds pixels of the given layout, and
+// reads its header. Returns -1 if there is no usable entry.
+static int open_entry(const char *key, int width, int height, int stride,
+		struct cache_header *header) {
+	char *dir = get_cache_dir();
+	if (!dir) {
+		return -1;
+	}
+	char *path = get_entry_path(dir, key);
+	free(dir);
+	if (!path) {
+		return -1;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd == -1) {
+		return -1;
+	}
+
+	char *entry_key = NULL;
+	struct stat st;
+	size_t key_len = strlen(key);
+	size_t data_size = (size_t)stride * height;
+	if (!pread_full(fd, header, sizeof(*header), 0) ||
+			memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+			header->key_len != key_len ||
+			header->width != (uint32_t)width ||
+			header->height != (uint32_t)height ||
+			header->stride != (uint32_t)stride ||
+			fstat(fd, &st) != 0 ||
+			(size_t)st.st_size < header->data_offset + data_size) {
+		goto fail;
+	}
+	entry_key = malloc(key_len);
+	if (!entry_key ||
+			!pread_full(fd, entry_key, key_len, sizeof(*header)) ||
+			memcmp(entry_key, key, key_len) != 0) {
+		goto fail;
+	}
+	free(entry_key);
+	return fd;
+
+fail:
+	free(entry_key);
+	close(fd);
+	return -1;
+}
+
+bool background_cache_contains(const char *key, int width, int height,
+		int stride) {
+	struct cache_header header;
+	int fd = open_entry(key, width, height, stride, &header);
+	if (fd == -1) {
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+bool background_cache_load(const char *key, void *data, int width,
+		int height, int stride, cairo_rectangle_int_t *opaque) {
+	struct cache_header header;
+	int fd = open_entry(key, width, height, stride, &header);
+	if (fd == -1) {
+		return false;
+	}
+	bool hit = pread_full(fd, data, (size_t)stride * height,
+		header.data_offset);
+	if (hit) {
+		*opaque = (cairo_rectangle_int_t){
+			header.opaque_x, header.opaque_y,
+			header.opaque_width, header.opaque_height,
+		};
+		// Entries are evicted by age; mark this one as recently used
+		futimens(fd, NULL);
+	}
+	close(fd);
+	return hit;
+}
+
+static void prune_cache(const char *dir, const char *keep) {
+	// Evict the least recently used entries until the cache fits again
+	while (true) {
+		DIR *d = opendir(dir);
+		if (!d) {
+			return;
+		}
+		long long total = 0;
+		char *oldest = NULL;
+		struct timespec oldest_time = {0};
+		struct dirent *entry;
+		while ((entry = readdir(d))) {
+			if (entry->d_name[0] == '.') {
+				continue;
+			}
+			size_t len = strlen(dir) + 1 + strlen(entry->d_name) + 1;
+			char *path = malloc(len);
+			if (!path) {
+				continue;
+			}
+			snprintf(path, len, "%s/%s", dir, entry->d_name);
+			struct stat st;
+			if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+				free(path);
+				continue;
+			}
+			total += st.st_size;
+			if (strcmp(path, keep) != 0 && (!oldest ||
+					st.st_mtim.tv_sec < oldest_time.tv_sec ||
+					(st.st_mtim.tv_sec == oldest_time.tv_sec &&
+						st.st_mtim.tv_nsec < oldest_time.tv_nsec))) {
+				free(oldest);
+				oldest = path;
+				oldest_time = st.st_mtim;
+			} else {
+				free(path);
+			}
+		}
+		closedir(d);
+
+		if (total <= CACHE_MAX_SIZE || !oldest) {
+			free(oldest);
+			return;
+		}
+		swaylock_log(LOG_DEBUG, "Evicting background cache entry %s", oldest);
+		unlink(oldest);
+		free(oldest);
+	}
+}
+
+void background_cache_store(const char *key, const void *data, int width,
+		int height, int stride, const cairo_rectangle_int_t *opaque) {
+	char *dir = get_cache_dir();
+	if (!dir) {
+		return;
+	}
+	char *path = get_entry_path(dir, key);
+	if (!path) {
+		free(dir);
+		return;
+	}
+	size_t tmp_len = strlen(path) + 32;
+	char *tmp_path = malloc(tmp_len);
+	if (!tmp_path) {
+		free(path);
+		free(dir);
+		return;
+	}
+	snprintf(tmp_path, tmp_len, "%s.%d.tmp", path, (int)getpid());
+
+	struct cache_header header = {
+		.key_len = strlen(key),
+		.width = width,
+		.height = height,
+		.stride = stride,
+		.opaque_x = opaque->x,
+		.opaque_y = opaque->y,
+		.opaque_width = opaque->width,
+		.opaque_height = opaque->height,
+	};
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.data_offset = sizeof(header) + header.key_len;
+	header.data_offset += CACHE_DATA_ALIGN - 1;
+	header.data_offset -= header.data_offset % CACHE_DATA_ALIGN;
+
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		swaylock_log_errno(LOG_DEBUG, "Unable to create %s", tmp_path);
+		goto out;
+	}
+	bool ok = pwrite_full(fd, &header, sizeof(header), 0) &&
+		pwrite_full(fd, key, header.key_len, sizeof(header)) &&
+		pwrite_full(fd, data, (size_t)stride * height, header.data_offset);
+	if (close(fd) != 0 || !ok) {
+		swaylock_log_errno(LOG_DEBUG, "Unable to write %s", tmp_path);
+		unlink(tmp_path);
+		goto out;
+	}
+	if (rename(tmp_path, path) != 0) {
+		unlink(tmp_path);
+		goto out;
+	}
+	swaylock_log(LOG_DEBUG, "Stored %dx%d background in %s",
+			width, height, path);
+	prune_cache(dir, path);
+
+out:
+	free(tmp_path);
+	free(path);
+	free(dir);
+}
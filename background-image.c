@@ -1,7 +1,22 @@
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "background-image.h"
 #include "cairo.h"
+#include "image-scale.h"
 #include "log.h"
+#include "pixel-convert.h"
+#if HAVE_LIBJPEG
+#include <jpeglib.h>
+#endif
+#if HAVE_LIBPNG
+#include <png.h>
+#endif
 
 enum background_mode parse_background_mode(const char *mode) {
 	if (strcmp(mode, "stretch") == 0) {
@@ -21,25 +36,401 @@ enum background_mode parse_background_mode(const char *mode) {
 	return BACKGROUND_MODE_INVALID;
 }
 
-cairo_surface_t *load_background_image(const char *path) {
-	cairo_surface_t *image;
+enum image_filter parse_scaling_filter(const char *filter) {
+	if (strcmp(filter, "nearest") == 0) {
+		return IMAGE_FILTER_NEAREST;
+	} else if (strcmp(filter, "bilinear") == 0) {
+		return IMAGE_FILTER_BILINEAR;
+	} else if (strcmp(filter, "good") == 0) {
+		return IMAGE_FILTER_GOOD;
+	} else if (strcmp(filter, "best") == 0) {
+		return IMAGE_FILTER_BEST;
+	} else if (strcmp(filter, "auto") == 0) {
+		return IMAGE_FILTER_AUTO;
+	}
+	swaylock_log(LOG_ERROR, "Unsupported scaling filter: %s", filter);
+	return IMAGE_FILTER_INVALID;
+}
+
+enum image_filter background_image_filter(enum image_filter filter,
+		enum image_filter limit, enum background_mode mode, int image_width,
+		int image_height, int buffer_width, int buffer_height) {
+	if (filter != IMAGE_FILTER_AUTO) {
+		return filter;
+	}
+	double sx = (double)buffer_width / image_width;
+	double sy = (double)buffer_height / image_height;
+	switch (mode) {
+	case BACKGROUND_MODE_STRETCH:
+		break;
+	case BACKGROUND_MODE_FILL:
+		sx = sy = fmax(sx, sy);
+		break;
+	case BACKGROUND_MODE_FIT:
+		sx = sy = fmin(sx, sy);
+		break;
+	default:
+		sx = sy = 1;
+		break;
+	}
+	// Unscaled images are copied, enlarged ones are smooth enough with
+	// bilinear filtering, and reduced ones need every pixel to count
+	if (sx < 1 || sy < 1) {
+		filter = IMAGE_FILTER_GOOD;
+	} else if (sx > 1 || sy > 1) {
+		filter = IMAGE_FILTER_BILINEAR;
+	} else {
+		filter = IMAGE_FILTER_NEAREST;
+	}
+	return filter < limit ? filter : limit;
+}
+
+double background_image_scale(enum background_mode mode, int image_width,
+		int image_height, int buffer_width, int buffer_height) {
+	double sx = (double)buffer_width / image_width;
+	double sy = (double)buffer_height / image_height;
+	// The same, should the output or the image turn out to be rotated
+	double tx = (double)buffer_height / image_width;
+	double ty = (double)buffer_width / image_height;
+	double scale;
+	switch (mode) {
+	case BACKGROUND_MODE_STRETCH:
+	case BACKGROUND_MODE_FILL:
+		scale = fmax(fmax(sx, sy), fmax(tx, ty));
+		break;
+	case BACKGROUND_MODE_FIT:
+		scale = fmax(fmin(sx, sy), fmin(tx, ty));
+		break;
+	default:
+		// Drawn at its original size
+		return 1;
+	}
+	return scale < 1 ? scale : 1;
+}
+
+#if HAVE_LIBJPEG
+struct jpeg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jmp;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+	char message[JMSG_LENGTH_MAX];
+	cinfo->err->format_message(cinfo, message);
+	swaylock_log(LOG_DEBUG, "libjpeg: %s", message);
+	longjmp(((struct jpeg_error *)cinfo->err)->jmp, 1);
+}
+
+static uint32_t exif_read(const uint8_t *data, int size, bool le) {
+	uint32_t value = 0;
+	for (int i = 0; i < size; ++i) {
+		value |= (uint32_t)data[le ? i : size - 1 - i] << (8 * i);
+	}
+	return value;
+}
+
+// Returns the orientation tag of the EXIF data in the APP1 markers, 1 if none
+static int jpeg_exif_orientation(j_decompress_ptr cinfo) {
+	for (jpeg_saved_marker_ptr marker = cinfo->marker_list; marker;
+			marker = marker->next) {
+		if (marker->marker != JPEG_APP0 + 1 || marker->data_length < 14 ||
+				memcmp(marker->data, "Exif\0\0", 6) != 0) {
+			continue;
+		}
+		const uint8_t *tiff = marker->data + 6;
+		size_t len = marker->data_length - 6;
+		bool le;
+		if (memcmp(tiff, "II", 2) == 0) {
+			le = true;
+		} else if (memcmp(tiff, "MM", 2) == 0) {
+			le = false;
+		} else {
+			continue;
+		}
+		size_t ifd = exif_read(tiff + 4, 4, le);
+		if (ifd > len - 2) {
+			continue;
+		}
+		size_t count = exif_read(tiff + ifd, 2, le);
+		for (size_t i = 0; i < count; ++i) {
+			size_t entry = ifd + 2 + 12 * i;
+			if (entry + 12 > len) {
+				break;
+			}
+			if (exif_read(tiff + entry, 2, le) == 0x0112) {
+				uint32_t orientation = exif_read(tiff + entry + 8, 2, le);
+				return orientation >= 1 && orientation <= 8 ? orientation : 1;
+			}
+		}
+	}
+	return 1;
+}
+
+static cairo_surface_t *load_jpeg(FILE *file, enum background_mode mode,
+		int max_width, int max_height, bool *downscaled) {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error err;
+	cairo_surface_t *volatile image = NULL;
+	uint32_t *volatile band = NULL;
+
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpeg_error_exit;
+	if (setjmp(err.jmp)) {
+		jpeg_destroy_decompress(&cinfo);
+		free(band);
+		if (image) {
+			cairo_surface_destroy(image);
+		}
+		return NULL;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, file);
+	jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xffff);
+	jpeg_read_header(&cinfo, TRUE);
+
+	if (cinfo.jpeg_color_space == JCS_CMYK ||
+			cinfo.jpeg_color_space == JCS_YCCK) {
+		swaylock_log(LOG_DEBUG, "libjpeg: CMYK images are not supported");
+		longjmp(err.jmp, 1);
+	}
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	cinfo.out_color_space = JCS_EXT_BGRX;
+#else
+	cinfo.out_color_space = JCS_EXT_XRGB;
+#endif
+	// Let the IDCT do the downscaling, by up to a factor of 8
+	if (max_width > 0 && max_height > 0) {
+		double scale = background_image_scale(mode, cinfo.image_width,
+			cinfo.image_height, max_width, max_height);
+		cinfo.scale_num = 1;
+		cinfo.scale_denom = 1;
+		while (cinfo.scale_denom < 8 && scale <= 0.5 / cinfo.scale_denom) {
+			cinfo.scale_denom *= 2;
+		}
+		*downscaled = cinfo.scale_denom > 1;
+	}
+	jpeg_start_decompress(&cinfo);
+
+	int w = cinfo.output_width, h = cinfo.output_height;
+	int orientation = jpeg_exif_orientation(&cinfo);
+	bool transposed = orientation >= 5;
+	image = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+		transposed ? h : w, transposed ? w : h);
+	if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+		longjmp(err.jmp, 1);
+	}
+	uint8_t *data = cairo_image_surface_get_data(image);
+	int stride = cairo_image_surface_get_stride(image);
+	if (orientation != 1 && orientation != 4) {
+		band = malloc((size_t)w * PIXEL_ORIENT_BAND_ROWS * sizeof(uint32_t));
+		if (!band) {
+			longjmp(err.jmp, 1);
+		}
+	}
+
+	// Scanlines are decoded straight into the surface, or into a band of
+	// rows that is then rotated into place
+	while (cinfo.output_scanline < cinfo.output_height) {
+		int y = cinfo.output_scanline;
+		JSAMPROW rows[PIXEL_ORIENT_BAND_ROWS];
+		int n = h - y < PIXEL_ORIENT_BAND_ROWS ? h - y : PIXEL_ORIENT_BAND_ROWS;
+		for (int i = 0; i < n; ++i) {
+			if (band) {
+				rows[i] = (JSAMPROW)(band + i * w);
+			} else if (orientation == 4) {
+				rows[i] = data + (h - 1 - (y + i)) * stride;
+			} else {
+				rows[i] = data + (y + i) * stride;
+			}
+		}
+		int read = 0;
+		while (read < n) {
+			read += jpeg_read_scanlines(&cinfo, rows + read, n - read);
+		}
+		if (band) {
+			pixel_store_oriented_rows((uint32_t *)data, stride / 4, band,
+				w, h, y, n, orientation);
+		}
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	free(band);
+	cairo_surface_mark_dirty(image);
+	return image;
+}
+#endif // HAVE_LIBJPEG
+
+#if HAVE_LIBPNG
+static void png_error_fn(png_structp png, png_const_charp message) {
+	swaylock_log(LOG_DEBUG, "libpng: %s", message);
+	png_longjmp(png, 1);
+}
+
+static void png_warning_fn(png_structp png, png_const_charp message) {
+	swaylock_log(LOG_DEBUG, "libpng: %s", message);
+}
+
+static cairo_surface_t *load_png(FILE *file) {
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+		png_error_fn, png_warning_fn);
+	if (!png) {
+		return NULL;
+	}
+	png_infop info = png_create_info_struct(png);
+	cairo_surface_t *volatile image = NULL;
+	uint8_t *volatile row = NULL;
+	if (!info || setjmp(png_jmpbuf(png))) {
+		png_destroy_read_struct(&png, &info, NULL);
+		free(row);
+		if (image) {
+			cairo_surface_destroy(image);
+		}
+		return NULL;
+	}
+	png_init_io(png, file);
+	png_read_info(png, info);
+
+	png_uint_32 w, h;
+	int depth, color_type, interlace;
+	png_get_IHDR(png, info, &w, &h, &depth, &color_type, &interlace,
+		NULL, NULL);
+	if (interlace != PNG_INTERLACE_NONE) {
+		// Would need the whole image in memory; leave it to the fallback
+		swaylock_log(LOG_DEBUG, "libpng: interlaced images are not supported");
+		png_longjmp(png, 1);
+	}
+	png_set_expand(png);
+	png_set_strip_16(png);
+	png_set_gray_to_rgb(png);
+	png_read_update_info(png, info);
+
+	bool alpha = png_get_channels(png, info) == 4;
+	image = cairo_image_surface_create(
+		alpha ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24, w, h);
+	if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+		png_longjmp(png, 1);
+	}
+	row = malloc(png_get_rowbytes(png, info));
+	if (!row) {
+		png_longjmp(png, 1);
+	}
+	uint8_t *data = cairo_image_surface_get_data(image);
+	int stride = cairo_image_surface_get_stride(image);
+	for (png_uint_32 y = 0; y < h; ++y) {
+		png_read_row(png, row, NULL);
+		uint32_t *dst = (uint32_t *)(data + y * stride);
+		if (alpha) {
+			pixel_convert_rgba_row(dst, row, w);
+		} else {
+			pixel_convert_rgb_row(dst, row, w);
+		}
+	}
+	png_read_end(png, NULL);
+	png_destroy_read_struct(&png, &info, NULL);
+	free(row);
+	cairo_surface_mark_dirty(image);
+	return image;
+}
+#endif // HAVE_LIBPNG
+
+#if HAVE_LIBJPEG || HAVE_LIBPNG
+// Decodes PNG and JPEG images without going through gdk-pixbuf, returns NULL
+// for anything else
+static cairo_surface_t *load_native_image(const char *path,
+		enum background_mode mode, int max_width, int max_height,
+		bool *downscaled, const char **decoder) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		return NULL;
+	}
+	uint8_t magic[8];
+	size_t len = fread(magic, 1, sizeof(magic), file);
+	rewind(file);
+
+	cairo_surface_t *image = NULL;
+#if HAVE_LIBPNG
+	if (len == sizeof(magic) && png_sig_cmp(magic, 0, sizeof(magic)) == 0) {
+		*decoder = "libpng";
+		image = load_png(file);
+	}
+#endif
+#if HAVE_LIBJPEG
+	if (len >= 3 && magic[0] == 0xff && magic[1] == 0xd8 && magic[2] == 0xff) {
+		*decoder = "libjpeg";
+		image = load_jpeg(file, mode, max_width, max_height, downscaled);
+	}
+#endif
+	fclose(file);
+	if (!image && *decoder) {
+		swaylock_log(LOG_DEBUG, "Failed to decode %s with %s, falling back",
+				path, *decoder);
+		*downscaled = false;
+	}
+	return image;
+}
+#endif
+
+static cairo_surface_t *load_fallback_image(const char *path,
+		enum background_mode mode, int max_width, int max_height,
+		bool *downscaled) {
 #if HAVE_GDK_PIXBUF
+	// Loaders that support it, like the JPEG one, downscale while decoding
+	int width, height, scaled_width = -1, scaled_height = -1;
+	if (max_width > 0 && max_height > 0 &&
+			gdk_pixbuf_get_file_info(path, &width, &height)) {
+		double scale = background_image_scale(mode, width, height,
+			max_width, max_height);
+		if (scale < 1) {
+			scaled_width = ceil(width * scale);
+			scaled_height = ceil(height * scale);
+			*downscaled = true;
+			swaylock_log(LOG_DEBUG, "Loading %s at %dx%d instead of %dx%d",
+					path, scaled_width, scaled_height, width, height);
+		}
+	}
+
 	GError *err = NULL;
-	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(path, &err);
+	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file_at_scale(path,
+		scaled_width, scaled_height, TRUE, &err);
 	if (!pixbuf) {
 		swaylock_log(LOG_ERROR, "Failed to load background image (%s).",
 				err->message);
+		g_error_free(err);
 		return NULL;
 	}
-	// Correct for embedded image orientation; typical images are not
-	// rotated and will be handled efficiently
-	GdkPixbuf *oriented = gdk_pixbuf_apply_embedded_orientation(pixbuf);
+	// Correct for embedded image orientation while converting, rather than
+	// through another full size copy of the pixbuf
+	const char *orientation = gdk_pixbuf_get_option(pixbuf, "orientation");
+	cairo_surface_t *image = gdk_cairo_image_surface_create_from_pixbuf(
+		pixbuf, orientation ? atoi(orientation) : 1);
 	g_object_unref(pixbuf);
-	image = gdk_cairo_image_surface_create_from_pixbuf(oriented);
-	g_object_unref(oriented);
+	return image;
 #else
-	image = cairo_image_surface_create_from_png(path);
+	(void)mode;
+	(void)max_width;
+	(void)max_height;
+	(void)downscaled;
+	return cairo_image_surface_create_from_png(path);
 #endif // HAVE_GDK_PIXBUF
+}
+
+cairo_surface_t *load_background_image(const char *path,
+		enum background_mode mode, int max_width, int max_height,
+		bool *downscaled) {
+	cairo_surface_t *image = NULL;
+	const char *decoder = NULL;
+	*downscaled = false;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+#if HAVE_LIBJPEG || HAVE_LIBPNG
+	image = load_native_image(path, mode, max_width, max_height,
+		downscaled, &decoder);
+#endif
+	if (!image) {
+		decoder = HAVE_GDK_PIXBUF ? "gdk-pixbuf" : "cairo";
+		image = load_fallback_image(path, mode, max_width, max_height,
+			downscaled);
+	}
 	if (!image) {
 		swaylock_log(LOG_ERROR, "Failed to read background image.");
 		return NULL;
@@ -53,11 +444,105 @@ cairo_surface_t *load_background_image(const char *path) {
 				, cairo_status_to_string(cairo_surface_status(image)));
 		return NULL;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	swaylock_log(LOG_DEBUG, "Decoded %s to %dx%d with %s in %.1f ms", path,
+			cairo_image_surface_get_width(image),
+			cairo_image_surface_get_height(image), decoder,
+			(end.tv_sec - start.tv_sec) * 1e3 +
+			(end.tv_nsec - start.tv_nsec) / 1e6);
 	return image;
 }
 
+// The rectangle render_background_image() places the image at, in buffer
+// pixels, or false for modes that don't scale it
+static bool get_image_rect(enum background_mode mode, double width,
+		double height, int buffer_width, int buffer_height,
+		double *x, double *y, double *w, double *h) {
+	double window_ratio = (double)buffer_width / buffer_height;
+	double bg_ratio = width / height;
+	*x = *y = 0;
+	*w = buffer_width;
+	*h = buffer_height;
+	switch (mode) {
+	case BACKGROUND_MODE_STRETCH:
+		return true;
+	case BACKGROUND_MODE_FILL:
+	case BACKGROUND_MODE_FIT:
+		if ((window_ratio > bg_ratio) == (mode == BACKGROUND_MODE_FILL)) {
+			*h = height * buffer_width / width;
+			*y = (buffer_height - *h) / 2;
+		} else {
+			*w = width * buffer_height / height;
+			*x = (buffer_width - *w) / 2;
+		}
+		return true;
+	default:
+		return false;
+	}
+}
+
+cairo_rectangle_int_t background_image_coverage(enum background_mode mode,
+		int image_width, int image_height, int buffer_width,
+		int buffer_height) {
+	double x, y, w, h;
+	if (mode == BACKGROUND_MODE_CENTER) {
+		// Aligned like render_background_image() does
+		x = (int)((double)buffer_width / 2 - (double)image_width / 2);
+		y = (int)((double)buffer_height / 2 - (double)image_height / 2);
+		w = image_width;
+		h = image_height;
+	} else if (!get_image_rect(mode, image_width, image_height, buffer_width,
+			buffer_height, &x, &y, &w, &h)) {
+		x = y = 0;
+		w = buffer_width;
+		h = buffer_height;
+	}
+	// Edge pixels only partially covered may be blended with the color
+	int x0 = fmax(ceil(x), 0), y0 = fmax(ceil(y), 0);
+	int x1 = fmin(floor(x + w), buffer_width);
+	int y1 = fmin(floor(y + h), buffer_height);
+	if (x1 <= x0 || y1 <= y0) {
+		return (cairo_rectangle_int_t){0};
+	}
+	return (cairo_rectangle_int_t){x0, y0, x1 - x0, y1 - y0};
+}
+
+bool render_background_image_direct(uint32_t *data, int stride,
+		int buffer_width, int buffer_height, cairo_surface_t *image,
+		enum background_mode mode, uint32_t color, enum image_filter filter,
+		int tile_x, int tile_y) {
+	double width = cairo_image_surface_get_width(image);
+	double height = cairo_image_surface_get_height(image);
+	double x = 0, y = 0, w = 0, h = 0;
+	if (mode != BACKGROUND_MODE_TILE && !get_image_rect(mode, width, height,
+			buffer_width, buffer_height, &x, &y, &w, &h)) {
+		return false;
+	}
+
+	// The color is given as RGBA, the buffer wants premultiplied ARGB
+	uint32_t a = color & 0xff;
+	uint32_t background = a << 24;
+	for (int shift = 8; shift < 32; shift += 8) {
+		uint32_t z = (color >> shift & 0xff) * a + 0x80;
+		background |= ((z + (z >> 8)) >> 8) << (shift - 8);
+	}
+
+	cairo_surface_flush(image);
+	const uint32_t *src = (const uint32_t *)cairo_image_surface_get_data(image);
+	int src_stride = cairo_image_surface_get_stride(image);
+	bool src_alpha = cairo_image_surface_get_format(image) == CAIRO_FORMAT_ARGB32;
+	if (mode == BACKGROUND_MODE_TILE) {
+		image_tile(data, stride, buffer_width, buffer_height, src, src_stride,
+			width, height, src_alpha, tile_x, tile_y, background);
+		return true;
+	}
+	return image_scale(data, stride, buffer_width, buffer_height, src,
+		src_stride, width, height, src_alpha, x, y, w, h, background, filter);
+}
+
 void render_background_image(cairo_t *cairo, cairo_surface_t *image,
-		enum background_mode mode, int buffer_width, int buffer_height) {
+		enum background_mode mode, int buffer_width, int buffer_height,
+		enum image_filter filter, int tile_x, int tile_y) {
 	double width = cairo_image_surface_get_width(image);
 	double height = cairo_image_surface_get_height(image);
 
@@ -116,7 +601,11 @@ void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 	case BACKGROUND_MODE_TILE: {
 		cairo_pattern_t *pattern = cairo_pattern_create_for_surface(image);
 		cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
+		cairo_matrix_t matrix;
+		cairo_matrix_init_translate(&matrix, -tile_x, -tile_y);
+		cairo_pattern_set_matrix(pattern, &matrix);
 		cairo_set_source(cairo, pattern);
+		cairo_pattern_destroy(pattern);
 		break;
 	}
 	case BACKGROUND_MODE_SOLID_COLOR:
@@ -124,6 +613,16 @@ void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 		assert(0);
 		break;
 	}
+	static const cairo_filter_t cairo_filters[] = {
+		[IMAGE_FILTER_NEAREST] = CAIRO_FILTER_NEAREST,
+		[IMAGE_FILTER_BILINEAR] = CAIRO_FILTER_BILINEAR,
+		[IMAGE_FILTER_GOOD] = CAIRO_FILTER_GOOD,
+		[IMAGE_FILTER_BEST] = CAIRO_FILTER_BEST,
+	};
+	if (filter <= IMAGE_FILTER_BEST) {
+		cairo_pattern_set_filter(cairo_get_source(cairo),
+			cairo_filters[filter]);
+	}
 	cairo_paint(cairo);
 	cairo_restore(cairo);
 }
@@ -0,0 +1,199 @@
+// Times decoding background images with the native libpng and libjpeg
+// decoders against the gdk-pixbuf fallback, at full size and for a 1080p
+// output.
+//
+// Usage: bench-decode [image...]
+// Without arguments, a generated 6000x4000 PNG and JPEG are decoded.
+#include "../background-image.c"
+#include <unistd.h>
+
+#define REPEATS 3
+#define GENERATED_WIDTH 6000
+#define GENERATED_HEIGHT 4000
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Smooth gradients with some noise, roughly like a photo
+static void fill_row(uint8_t *row, int y, int width, int height,
+		uint32_t *seed) {
+	for (int x = 0; x < width; ++x) {
+		*seed = *seed * 1103515245 + 12345;
+		uint8_t noise = *seed >> 28;
+		row[x * 3] = x * 255 / width + noise;
+		row[x * 3 + 1] = y * 255 / height + noise;
+		row[x * 3 + 2] = (x + y) * 127 / (width + height) + noise;
+	}
+}
+
+#if HAVE_LIBPNG
+static bool write_png(FILE *file, int width, int height) {
+	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+		NULL, NULL, NULL);
+	png_infop info = png ? png_create_info_struct(png) : NULL;
+	uint8_t *row = malloc((size_t)width * 3);
+	if (!info || !row || setjmp(png_jmpbuf(png))) {
+		png_destroy_write_struct(&png, &info);
+		free(row);
+		return false;
+	}
+	png_init_io(png, file);
+	png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+		PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png, info);
+	uint32_t seed = 1;
+	for (int y = 0; y < height; ++y) {
+		fill_row(row, y, width, height, &seed);
+		png_write_row(png, row);
+	}
+	png_write_end(png, NULL);
+	png_destroy_write_struct(&png, &info);
+	free(row);
+	return true;
+}
+#endif
+
+#if HAVE_LIBJPEG
+static bool write_jpeg(FILE *file, int width, int height) {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, file);
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, 90, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	uint8_t *row = malloc((size_t)width * 3);
+	if (!row) {
+		jpeg_destroy_compress(&cinfo);
+		return false;
+	}
+	uint32_t seed = 1;
+	for (int y = 0; y < height; ++y) {
+		fill_row(row, y, width, height, &seed);
+		JSAMPROW rows[] = {row};
+		jpeg_write_scanlines(&cinfo, rows, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	free(row);
+	return true;
+}
+#endif
+
+// The decoders go by the file's contents, so it needs no extension
+static char *generate(bool (*write)(FILE *file, int width, int height)) {
+	char *path = strdup("/tmp/swaylock-bench-XXXXXX");
+	int fd = path ? mkstemp(path) : -1;
+	FILE *file = fd == -1 ? NULL : fdopen(fd, "wb");
+	if (!file || !write(file, GENERATED_WIDTH, GENERATED_HEIGHT)) {
+		fprintf(stderr, "Failed to write a test image\n");
+		if (file) {
+			fclose(file);
+			unlink(path);
+		}
+		free(path);
+		return NULL;
+	}
+	fclose(file);
+	return path;
+}
+
+// Best of REPEATS decodes, negative if the decoder fails
+static double time_decode(const char *path, bool native, int max_width,
+		int max_height, int *width, int *height) {
+	double best = -1;
+	for (int i = 0; i < REPEATS; ++i) {
+		bool downscaled = false;
+		double start = now_ms();
+		cairo_surface_t *image = NULL;
+		if (native) {
+#if HAVE_LIBJPEG || HAVE_LIBPNG
+			const char *decoder = NULL;
+			image = load_native_image(path, BACKGROUND_MODE_FILL,
+				max_width, max_height, &downscaled, &decoder);
+#endif
+		} else {
+			image = load_fallback_image(path, BACKGROUND_MODE_FILL,
+				max_width, max_height, &downscaled);
+		}
+		double elapsed = now_ms() - start;
+		if (!image || cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+			if (image) {
+				cairo_surface_destroy(image);
+			}
+			return -1;
+		}
+		*width = cairo_image_surface_get_width(image);
+		*height = cairo_image_surface_get_height(image);
+		cairo_surface_destroy(image);
+		if (best < 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+	return best;
+}
+
+static void bench(const char *path) {
+	static const struct {
+		const char *name;
+		int width, height;
+	} targets[] = {
+		{"full", 0, 0},
+		{"1080p", 1920, 1080},
+	};
+	const char *fallback = HAVE_GDK_PIXBUF ? "gdk-pixbuf" : "cairo";
+	for (size_t t = 0; t < sizeof(targets) / sizeof(targets[0]); ++t) {
+		int native_w = 0, native_h = 0, fallback_w = 0, fallback_h = 0;
+		double native_ms = time_decode(path, true, targets[t].width,
+			targets[t].height, &native_w, &native_h);
+		double fallback_ms = time_decode(path, false, targets[t].width,
+			targets[t].height, &fallback_w, &fallback_h);
+		printf("%s (%s)\n", path, targets[t].name);
+		if (native_ms >= 0) {
+			printf("  native      %4dx%-4d %8.1f ms\n",
+					native_w, native_h, native_ms);
+		} else {
+			printf("  native      unsupported\n");
+		}
+		if (fallback_ms >= 0) {
+			printf("  %-11s %4dx%-4d %8.1f ms\n", fallback,
+					fallback_w, fallback_h, fallback_ms);
+		} else {
+			printf("  %-11s unsupported\n", fallback);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	for (int i = 1; i < argc; ++i) {
+		bench(argv[i]);
+	}
+	if (argc > 1) {
+		return EXIT_SUCCESS;
+	}
+
+	char *generated[2] = {0};
+#if HAVE_LIBPNG
+	generated[0] = generate(write_png);
+#endif
+#if HAVE_LIBJPEG
+	generated[1] = generate(write_jpeg);
+#endif
+	for (int i = 0; i < 2; ++i) {
+		if (generated[i]) {
+			bench(generated[i]);
+			unlink(generated[i]);
+			free(generated[i]);
+		}
+	}
+	return EXIT_SUCCESS;
+}
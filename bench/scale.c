@@ -0,0 +1,139 @@
+// Times rendering a background image onto 4K and 8K buffers through cairo,
+// as swaylock used to, and straight into the pixels with
+// render_background_image_direct(), for every scaling filter.
+//
+// Usage: bench-scale [repeats]
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "background-image.h"
+#include "cairo.h"
+
+#define COLOR 0x202020ff
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Smooth gradients with some noise, roughly like a photo
+static cairo_surface_t *create_image(int width, int height) {
+	cairo_surface_t *image =
+		cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	uint32_t *data = (uint32_t *)cairo_image_surface_get_data(image);
+	int stride = cairo_image_surface_get_stride(image) / 4;
+	uint32_t seed = 1;
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			seed = seed * 1103515245 + 12345;
+			uint32_t noise = seed >> 28;
+			uint32_t r = (x * 255 / width + noise) & 0xff;
+			uint32_t g = (y * 255 / height + noise) & 0xff;
+			uint32_t b = ((x + y) * 127 / (width + height) + noise) & 0xff;
+			data[y * stride + x] = r << 16 | g << 8 | b;
+		}
+	}
+	cairo_surface_mark_dirty(image);
+	return image;
+}
+
+static double time_cairo(uint32_t *data, int width, int height,
+		cairo_surface_t *image, enum image_filter filter, int repeats) {
+	cairo_surface_t *surface = cairo_image_surface_create_for_data(
+		(unsigned char *)data, CAIRO_FORMAT_ARGB32, width, height, width * 4);
+	cairo_t *cairo = cairo_create(surface);
+	double best = 0;
+	for (int i = 0; i < repeats; ++i) {
+		double start = now_ms();
+		cairo_save(cairo);
+		cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_u32(cairo, COLOR);
+		cairo_paint(cairo);
+		cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
+		render_background_image(cairo, image, BACKGROUND_MODE_FILL,
+			width, height, filter, 0, 0);
+		cairo_restore(cairo);
+		cairo_surface_flush(surface);
+		double elapsed = now_ms() - start;
+		if (i == 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+	cairo_destroy(cairo);
+	cairo_surface_destroy(surface);
+	return best;
+}
+
+static double time_direct(uint32_t *data, int width, int height,
+		cairo_surface_t *image, enum image_filter filter, int repeats) {
+	double best = 0;
+	for (int i = 0; i < repeats; ++i) {
+		double start = now_ms();
+		render_background_image_direct(data, width * 4, width, height, image,
+			BACKGROUND_MODE_FILL, COLOR, filter, 0, 0);
+		double elapsed = now_ms() - start;
+		if (i == 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+	return best;
+}
+
+int main(int argc, char **argv) {
+	int repeats = argc > 1 ? atoi(argv[1]) : 3;
+	if (repeats < 1) {
+		repeats = 1;
+	}
+	static const struct {
+		const char *name;
+		int width, height;
+	} buffers[] = {
+		{"4K", 3840, 2160},
+		{"8K", 7680, 4320},
+	};
+	static const char *filter_names[] = {
+		[IMAGE_FILTER_NEAREST] = "nearest",
+		[IMAGE_FILTER_BILINEAR] = "bilinear",
+		[IMAGE_FILTER_GOOD] = "good",
+		[IMAGE_FILTER_BEST] = "best",
+	};
+	// Enlarged onto 4K and 8K alike, and reduced onto 4K
+	static const struct {
+		int width, height;
+	} images[] = {
+		{2560, 1600},
+		{6000, 4000},
+	};
+
+	printf("%-6s %-10s %-8s %10s %10s %8s\n", "buffer", "image", "filter",
+			"cairo ms", "direct ms", "speedup");
+	for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); ++i) {
+		cairo_surface_t *image = create_image(images[i].width,
+			images[i].height);
+		char image_size[32];
+		snprintf(image_size, sizeof(image_size), "%dx%d",
+				images[i].width, images[i].height);
+		for (size_t b = 0; b < sizeof(buffers) / sizeof(buffers[0]); ++b) {
+			int width = buffers[b].width, height = buffers[b].height;
+			uint32_t *data = malloc((size_t)width * height * 4);
+			if (!data) {
+				fprintf(stderr, "Out of memory\n");
+				return EXIT_FAILURE;
+			}
+			for (int f = IMAGE_FILTER_NEAREST; f <= IMAGE_FILTER_BEST; ++f) {
+				double cairo_ms = time_cairo(data, width, height, image, f,
+					repeats);
+				double direct_ms = time_direct(data, width, height, image, f,
+					repeats);
+				printf("%-6s %-10s %-8s %10.1f %10.1f %7.1fx\n",
+						buffers[b].name, image_size, filter_names[f], cairo_ms,
+						direct_ms, cairo_ms / direct_ms);
+			}
+			free(data);
+		}
+		cairo_surface_destroy(image);
+	}
+	return EXIT_SUCCESS;
+}
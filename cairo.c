@@ -1,6 +1,9 @@
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <cairo/cairo.h>
 #include "cairo.h"
+#include "pixel-convert.h"
 #if HAVE_GDK_PIXBUF
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #endif
@@ -30,7 +33,8 @@ cairo_subpixel_order_t to_cairo_subpixel_order(enum wl_output_subpixel subpixel)
 }
 
 #if HAVE_GDK_PIXBUF
-cairo_surface_t* gdk_cairo_image_surface_create_from_pixbuf(const GdkPixbuf *gdkbuf) {
+cairo_surface_t* gdk_cairo_image_surface_create_from_pixbuf(
+		const GdkPixbuf *gdkbuf, int orientation) {
 	int chan = gdk_pixbuf_get_n_channels(gdkbuf);
 	if (chan < 3) {
 		return NULL;
@@ -44,8 +48,14 @@ cairo_surface_t* gdk_cairo_image_surface_create_from_pixbuf(const GdkPixbuf *gdk
 	gint h = gdk_pixbuf_get_height(gdkbuf);
 	int stride = gdk_pixbuf_get_rowstride(gdkbuf);
 
+	if (orientation < 1 || orientation > 8) {
+		orientation = 1;
+	}
+	bool transposed = orientation >= 5;
+
 	cairo_format_t fmt = (chan == 3) ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32;
-	cairo_surface_t * cs = cairo_image_surface_create (fmt, w, h);
+	cairo_surface_t * cs = cairo_image_surface_create (fmt,
+		transposed ? h : w, transposed ? w : h);
 	cairo_surface_flush (cs);
 	if ( !cs || cairo_surface_status(cs) != CAIRO_STATUS_SUCCESS) {
 		return NULL;
@@ -54,72 +64,41 @@ cairo_surface_t* gdk_cairo_image_surface_create_from_pixbuf(const GdkPixbuf *gdk
 	int cstride = cairo_image_surface_get_stride(cs);
 	unsigned char * cpix = cairo_image_surface_get_data(cs);
 
-	if (chan == 3) {
-		int i;
-		for (i = h; i; --i) {
-			const guint8 *gp = gdkpix;
-			unsigned char *cp = cpix;
-			const guint8* end = gp + 3*w;
-			while (gp < end) {
-#if G_BYTE_ORDER == G_LITTLE_ENDIAN
-				cp[0] = gp[2];
-				cp[1] = gp[1];
-				cp[2] = gp[0];
-#else
-				cp[1] = gp[0];
-				cp[2] = gp[1];
-				cp[3] = gp[2];
-#endif
-				gp += 3;
-				cp += 4;
-			}
-			gdkpix += stride;
-			cpix += cstride;
+	// Upright and vertically flipped rows are converted straight into the
+	// surface; other orientations go through a small band of rows
+	uint32_t *band = NULL;
+	if (orientation != 1 && orientation != 4) {
+		band = malloc((size_t)w * PIXEL_ORIENT_BAND_ROWS * sizeof(uint32_t));
+		if (!band) {
+			cairo_surface_destroy(cs);
+			return NULL;
 		}
-	} else {
-		/* premul-color = alpha/255 * color/255 * 255 = (alpha*color)/255
-		 * (z/255) = z/256 * 256/255     = z/256 (1 + 1/255)
-		 *         = z/256 + (z/256)/255 = (z + z/255)/256
-		 *         # recurse once
-		 *         = (z + (z + z/255)/256)/256
-		 *         = (z + z/256 + z/256/255) / 256
-		 *         # only use 16bit uint operations, loose some precision,
-		 *         # result is floored.
-		 *       ->  (z + z>>8)>>8
-		 *         # add 0x80/255 = 0.5 to convert floor to round
-		 *       =>  (z+0x80 + (z+0x80)>>8 ) >> 8
-		 * ------
-		 * tested as equal to lround(z/255.0) for uint z in [0..0xfe02]
-		 */
-#define PREMUL_ALPHA(x,a,b,z) \
-		G_STMT_START { z = a * b + 0x80; x = (z + (z >> 8)) >> 8; } \
-		G_STMT_END
-		int i;
-		for (i = h; i; --i) {
-			const guint8 *gp = gdkpix;
-			unsigned char *cp = cpix;
-			const guint8* end = gp + 4*w;
-			guint z1, z2, z3;
-			while (gp < end) {
-#if G_BYTE_ORDER == G_LITTLE_ENDIAN
-				PREMUL_ALPHA(cp[0], gp[2], gp[3], z1);
-				PREMUL_ALPHA(cp[1], gp[1], gp[3], z2);
-				PREMUL_ALPHA(cp[2], gp[0], gp[3], z3);
-				cp[3] = gp[3];
-#else
-				PREMUL_ALPHA(cp[1], gp[0], gp[3], z1);
-				PREMUL_ALPHA(cp[2], gp[1], gp[3], z2);
-				PREMUL_ALPHA(cp[3], gp[2], gp[3], z3);
-				cp[0] = gp[3];
-#endif
-				gp += 4;
-				cp += 4;
+	}
+
+	for (int y = 0; y < h; y += PIXEL_ORIENT_BAND_ROWS) {
+		int n = h - y < PIXEL_ORIENT_BAND_ROWS ? h - y : PIXEL_ORIENT_BAND_ROWS;
+		for (int i = 0; i < n; ++i) {
+			uint32_t *row;
+			if (band) {
+				row = band + i * w;
+			} else if (orientation == 4) {
+				row = (uint32_t *)(cpix + (h - 1 - (y + i)) * cstride);
+			} else {
+				row = (uint32_t *)(cpix + (y + i) * cstride);
 			}
-			gdkpix += stride;
-			cpix += cstride;
+			const guint8 *gp = gdkpix + (y + i) * stride;
+			if (chan == 3) {
+				pixel_convert_rgb_row(row, gp, w);
+			} else {
+				pixel_convert_rgba_row(row, gp, w);
+			}
+		}
+		if (band) {
+			pixel_store_oriented_rows((uint32_t *)cpix, cstride / 4, band, w, h,
+				y, n, orientation);
 		}
-#undef PREMUL_ALPHA
 	}
+	free(band);
 	cairo_surface_mark_dirty(cs);
 	return cs;
 }
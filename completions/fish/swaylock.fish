@@ -1,5 +1,6 @@
 # swaylock(1) completion
 
+complete -c swaylock -l background-resolution       --description "Background resolution: full, half, or at most <pixels> or <width>x<height> pixels per output."
 complete -c swaylock -l bs-hl-color                 --description "Sets the color of backspace highlight segments."
 complete -c swaylock -l caps-lock-bs-hl-color       --description "Sets the color of backspace highlight segments when Caps Lock is active."
 complete -c swaylock -l caps-lock-key-hl-color      --description "Sets the color of the key press highlight segments when Caps Lock is active."
@@ -37,12 +38,14 @@ complete -c swaylock -l line-uses-ring         -s r --description "Use the ring
 complete -c swaylock -l line-ver-color              --description "Sets the color of the line between the inside and ring when verifying."
 complete -c swaylock -l line-wrong-color            --description "Sets the color of the line between the inside and ring when invalid."
 complete -c swaylock -l no-unlock-indicator    -s u --description "Disable the unlock indicator."
+complete -c swaylock -l progressive-image           --description "Lock with the background color and show the image once it is decoded."
 complete -c swaylock -l ring-caps-lock-color        --description "Sets the color of the ring of the indicator when Caps Lock is active."
 complete -c swaylock -l ring-clear-color            --description "Sets the color of the ring of the indicator when cleared."
 complete -c swaylock -l ring-color                  --description "Sets the color of the ring of the indicator."
 complete -c swaylock -l ring-ver-color              --description "Sets the color of the ring of the indicator when verifying."
 complete -c swaylock -l ring-wrong-color            --description "Sets the color of the ring of the indicator when invalid."
 complete -c swaylock -l scaling                -s s --description "Image scaling mode: stretch, fill, fit, center, tile, solid_color."
+complete -c swaylock -l scaling-filter              --description "Image scaling filter: nearest, bilinear, good, best, auto."
 complete -c swaylock -l separator-color             --description "Sets the color of the lines that separate highlight segments."
 complete -c swaylock -l show-failed-attempts   -s F --description "Show current count of failed authentication attempts."
 complete -c swaylock -l show-keyboard-layout   -s k --description "Display the current xkb layout while typing."
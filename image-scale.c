@@ -0,0 +1,445 @@
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image-scale.h"
+#include "log.h"
+
+// Filter weights are fixed point numbers with this many fractional bits
+#define WEIGHT_BITS 14
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+
+// Large images are scaled in horizontal bands, one thread each. Bands share
+// nothing but the source image and write disjoint rows of the destination.
+#define MAX_BANDS 16
+#define MIN_BAND_ROWS 64
+
+// One premultiplied ARGB32 pixel, one channel per lane. The filter loops are
+// written with these so that each multiply-add covers all four channels.
+typedef int32_t v4si __attribute__((vector_size(16)));
+
+static inline v4si unpack(uint32_t p) {
+	return (v4si){p & 0xff, p >> 8 & 0xff, p >> 16 & 0xff, p >> 24};
+}
+
+static inline uint32_t pack(v4si v) {
+	return (uint32_t)v[0] | (uint32_t)v[1] << 8 |
+		(uint32_t)v[2] << 16 | (uint32_t)v[3] << 24;
+}
+
+// Composites src over the background, rounding like the premultiplication
+static inline v4si over(v4si src, v4si background) {
+	v4si t = background * (255 - src[3]) + 0x80;
+	return src + ((t + (t >> 8)) >> 8);
+}
+
+// Clamps a filtered pixel with overshoot back to valid premultiplied values
+static inline v4si clamp(v4si v) {
+	v &= v > (v4si){0};
+	int32_t a = v[3] < 255 ? v[3] : 255;
+	v4si max = {a, a, a, 255};
+	v4si below = v < max;
+	return (v & below) | (max & ~below);
+}
+
+// Source pixels contributing to each destination pixel along one axis
+struct axis {
+	int first, last; // destination pixels covered by the image
+	int taps; // maximum number of source pixels per destination pixel
+	int *start, *count;
+	int16_t *weights; // taps per destination pixel, summing to WEIGHT_ONE
+	bool overshoot; // some weights are negative
+};
+
+struct scaler {
+	uint32_t *dst;
+	int dst_stride;
+	const uint32_t *src;
+	int src_stride;
+	bool src_alpha;
+	v4si background;
+	struct axis x, y;
+};
+
+static void axis_finish(struct axis *axis) {
+	free(axis->start);
+	free(axis->count);
+	free(axis->weights);
+}
+
+// Catmull-Rom cubic, the weight of a pixel center at distance d
+static double cubic(double d) {
+	d = fabs(d);
+	if (d < 1) {
+		return (1.5 * d - 2.5) * d * d + 1;
+	} else if (d < 2) {
+		return ((-0.5 * d + 2.5) * d - 4) * d + 2;
+	}
+	return 0;
+}
+
+static bool axis_init(struct axis *axis, int dst_size, int src_size,
+		double offset, double size, enum image_filter filter) {
+	*axis = (struct axis){0};
+	// Destination pixels whose centers lie within the image
+	double first = ceil(offset - 0.5);
+	double last = ceil(offset + size - 0.5);
+	axis->first = first < 0 ? 0 : first > dst_size ? dst_size : first;
+	axis->last = last < 0 ? 0 : last > dst_size ? dst_size : last;
+	int n = axis->last - axis->first;
+	if (n <= 0) {
+		axis->first = axis->last = 0;
+		return true;
+	}
+
+	// Source pixels per destination pixel
+	double ratio = src_size / size;
+	bool downscale = ratio > 1;
+	switch (filter) {
+	case IMAGE_FILTER_NEAREST:
+		axis->taps = 1;
+		break;
+	case IMAGE_FILTER_BILINEAR:
+		axis->taps = 2;
+		break;
+	case IMAGE_FILTER_GOOD:
+		axis->taps = downscale ? (int)ceil(ratio) + 1 : 2;
+		break;
+	default:
+		axis->taps = downscale ? 2 * (int)ceil(ratio) + 2 : 4;
+		break;
+	}
+	axis->start = calloc(n, sizeof(int));
+	axis->count = calloc(n, sizeof(int));
+	axis->weights = calloc((size_t)n * axis->taps, sizeof(int16_t));
+	double *weights = calloc(axis->taps, sizeof(double));
+	if (!axis->start || !axis->count || !axis->weights || !weights) {
+		free(weights);
+		axis_finish(axis);
+		return false;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		double u = (axis->first + i + 0.5 - offset) * ratio;
+		int start, count;
+		if (filter == IMAGE_FILTER_NEAREST) {
+			start = fmin(fmax(floor(u), 0), src_size - 1);
+			count = 1;
+			weights[0] = 1;
+		} else if (filter == IMAGE_FILTER_GOOD && downscale) {
+			// Box filter: average the source pixels under the footprint
+			double lo = fmax(u - ratio / 2, 0);
+			double hi = fmin(u + ratio / 2, src_size);
+			start = floor(lo);
+			count = (int)ceil(hi) - start;
+			for (int k = 0; k < count; ++k) {
+				weights[k] = fmin(hi, start + k + 1) - fmax(lo, start + k);
+			}
+		} else if (filter == IMAGE_FILTER_BEST && downscale) {
+			// Tent filter twice as wide as the footprint, which blurs
+			// less than the box filter aliases
+			start = fmax(ceil(u - ratio - 0.5), 0);
+			int end = fmin(floor(u + ratio - 0.5), src_size - 1);
+			count = end - start + 1;
+			for (int k = 0; k < count; ++k) {
+				weights[k] = 1 - fabs(start + k + 0.5 - u) / ratio;
+			}
+		} else if (filter == IMAGE_FILTER_BEST) {
+			// Bicubic: taps past the edges fold into the edge pixels
+			double v = fmin(fmax(u - 0.5, 0), src_size - 1);
+			int center = floor(v);
+			start = center - 1 < 0 ? 0 : center - 1;
+			int end = center + 2 > src_size - 1 ? src_size - 1 : center + 2;
+			count = end - start + 1;
+			for (int k = 0; k < count; ++k) {
+				weights[k] = 0;
+			}
+			for (int k = center - 1; k <= center + 2; ++k) {
+				int j = k < start ? start : k > end ? end : k;
+				weights[j - start] += cubic(v - k);
+			}
+		} else {
+			// Bilinear filter between the two nearest pixel centers
+			double v = fmin(fmax(u - 0.5, 0), src_size - 1);
+			start = floor(v);
+			double f = v - start;
+			count = f > 0 ? 2 : 1;
+			weights[0] = 1 - f;
+			weights[1] = f;
+		}
+		if (count < 1) {
+			// A tent narrower than a pixel can miss all pixel centers
+			start = fmin(fmax(floor(u), 0), src_size - 1);
+			count = 1;
+			weights[0] = 1;
+		}
+
+		double total = 0;
+		for (int k = 0; k < count; ++k) {
+			total += weights[k];
+		}
+		int16_t *fixed = axis->weights + i * axis->taps;
+		int sum = 0, largest = 0;
+		for (int k = 0; k < count; ++k) {
+			fixed[k] = lround(weights[k] / total * WEIGHT_ONE);
+			sum += fixed[k];
+			if (fixed[k] > fixed[largest]) {
+				largest = k;
+			}
+			if (fixed[k] < 0) {
+				axis->overshoot = true;
+			}
+		}
+		// Keep the weights summing up exactly, so flat areas stay flat
+		fixed[largest] += WEIGHT_ONE - sum;
+		axis->start[i] = start;
+		axis->count[i] = count;
+	}
+	free(weights);
+	return true;
+}
+
+static void scale_row(const struct scaler *scaler, const uint32_t *src,
+		uint32_t *out) {
+	const struct axis *axis = &scaler->x;
+	int n = axis->last - axis->first;
+	// The alpha byte of opaque sources is undefined, but clamp() caps the
+	// color channels at it
+	uint32_t alpha = scaler->src_alpha ? 0 : 0xff000000;
+	for (int i = 0; i < n; ++i) {
+		const uint32_t *p = src + axis->start[i];
+		const int16_t *w = axis->weights + i * axis->taps;
+		v4si acc = {0};
+		for (int k = 0; k < axis->count[i]; ++k) {
+			acc += unpack(p[k] | alpha) * (int32_t)w[k];
+		}
+		acc = (acc + WEIGHT_ONE / 2) >> WEIGHT_BITS;
+		out[i] = pack(axis->overshoot ? clamp(acc) : acc);
+	}
+}
+
+// Renders destination rows [y0, y1), which must lie within the image
+static bool scale_rows(const struct scaler *scaler, int y0, int y1) {
+	const struct axis *axis = &scaler->y;
+	int width = scaler->x.last - scaler->x.first;
+	// Horizontally scaled source rows, indexed by source row modulo taps
+	int slots = axis->taps;
+	uint32_t *ring = malloc((size_t)slots * width * sizeof(uint32_t));
+	int *ring_rows = malloc(slots * sizeof(int));
+	const uint32_t **rows = malloc(slots * sizeof(uint32_t *));
+	if (!ring || !ring_rows || !rows) {
+		free(ring);
+		free(ring_rows);
+		free(rows);
+		return false;
+	}
+	for (int i = 0; i < slots; ++i) {
+		ring_rows[i] = -1;
+	}
+
+	uint32_t alpha = scaler->src_alpha ? 0 : 0xff000000;
+	for (int y = y0; y < y1; ++y) {
+		int i = y - axis->first;
+		int count = axis->count[i];
+		const int16_t *w = axis->weights + i * axis->taps;
+		for (int k = 0; k < count; ++k) {
+			int row = axis->start[i] + k;
+			uint32_t *slot = ring + (row % slots) * width;
+			if (ring_rows[row % slots] != row) {
+				const uint32_t *src = (const uint32_t *)
+					((const uint8_t *)scaler->src + row * scaler->src_stride);
+				scale_row(scaler, src, slot);
+				ring_rows[row % slots] = row;
+			}
+			rows[k] = slot;
+		}
+
+		uint32_t *dst = (uint32_t *)((uint8_t *)scaler->dst +
+			y * scaler->dst_stride) + scaler->x.first;
+		for (int x = 0; x < width; ++x) {
+			v4si acc = {0};
+			for (int k = 0; k < count; ++k) {
+				acc += unpack(rows[k][x]) * (int32_t)w[k];
+			}
+			acc = (acc + WEIGHT_ONE / 2) >> WEIGHT_BITS;
+			if (axis->overshoot) {
+				acc = clamp(acc);
+			}
+			if (scaler->src_alpha) {
+				acc = over(acc, scaler->background);
+			}
+			dst[x] = pack(acc) | alpha;
+		}
+	}
+
+	free(ring);
+	free(ring_rows);
+	free(rows);
+	return true;
+}
+
+struct band {
+	const struct scaler *scaler;
+	int y0, y1;
+	bool ok;
+	pthread_t thread;
+	bool threaded;
+};
+
+static void *band_thread(void *data) {
+	struct band *band = data;
+	band->ok = scale_rows(band->scaler, band->y0, band->y1);
+	return NULL;
+}
+
+static int band_count(int rows) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int n = cpus < 1 ? 1 : cpus > MAX_BANDS ? MAX_BANDS : cpus;
+	if (n > rows / MIN_BAND_ROWS) {
+		n = rows / MIN_BAND_ROWS;
+	}
+	return n < 1 ? 1 : n;
+}
+
+static bool scale_bands(const struct scaler *scaler) {
+	int first = scaler->y.first, rows = scaler->y.last - first;
+	int n = band_count(rows);
+	if (n == 1) {
+		return scale_rows(scaler, first, first + rows);
+	}
+
+	struct band bands[MAX_BANDS];
+	for (int i = 0; i < n; ++i) {
+		bands[i] = (struct band){
+			.scaler = scaler,
+			.y0 = first + (int)((int64_t)rows * i / n),
+			.y1 = first + (int)((int64_t)rows * (i + 1) / n),
+		};
+	}
+	// The calling thread takes the first band itself
+	for (int i = 1; i < n; ++i) {
+		int err = pthread_create(&bands[i].thread, NULL, band_thread, &bands[i]);
+		bands[i].threaded = err == 0;
+		if (err != 0) {
+			swaylock_log(LOG_DEBUG, "Failed to start scaler thread, "
+				"scaling band %d inline", i);
+		}
+	}
+	band_thread(&bands[0]);
+
+	bool ok = true;
+	for (int i = 0; i < n; ++i) {
+		if (i > 0 && bands[i].threaded) {
+			pthread_join(bands[i].thread, NULL);
+		} else if (i > 0) {
+			band_thread(&bands[i]);
+		}
+		ok = ok && bands[i].ok;
+	}
+	return ok;
+}
+
+static void fill(uint32_t *dst, int n, uint32_t color) {
+	for (int i = 0; i < n; ++i) {
+		dst[i] = color;
+	}
+}
+
+bool image_scale(uint32_t *dst, int dst_stride, int dst_width, int dst_height,
+		const uint32_t *src, int src_stride, int src_width, int src_height,
+		bool src_alpha, double x, double y, double width, double height,
+		uint32_t background, enum image_filter filter) {
+	struct scaler scaler = {
+		.dst = dst,
+		.dst_stride = dst_stride,
+		.src = src,
+		.src_stride = src_stride,
+		.src_alpha = src_alpha,
+		.background = unpack(background),
+	};
+	if (!axis_init(&scaler.x, dst_width, src_width, x, width, filter)) {
+		return false;
+	}
+	if (!axis_init(&scaler.y, dst_height, src_height, y, height,
+			filter)) {
+		axis_finish(&scaler.x);
+		return false;
+	}
+
+	bool ok = true;
+	if (scaler.x.first < scaler.x.last && scaler.y.first < scaler.y.last) {
+		ok = scale_bands(&scaler);
+	} else {
+		scaler.y.first = scaler.y.last = 0;
+	}
+
+	// Only the borders left around the image get the background color
+	for (int row = 0; ok && row < dst_height; ++row) {
+		uint32_t *line = (uint32_t *)((uint8_t *)dst + row * dst_stride);
+		if (row < scaler.y.first || row >= scaler.y.last) {
+			fill(line, dst_width, background);
+		} else {
+			fill(line, scaler.x.first, background);
+			fill(line + scaler.x.last, dst_width - scaler.x.last, background);
+		}
+	}
+
+	axis_finish(&scaler.x);
+	axis_finish(&scaler.y);
+	return ok;
+}
+
+void image_tile(uint32_t *dst, int dst_stride, int dst_width, int dst_height,
+		const uint32_t *src, int src_stride, int src_width, int src_height,
+		bool src_alpha, int x, int y, uint32_t background) {
+	// The first row of tiles is composited once, widening each row by
+	// doubling it, and then copied down the buffer in doubling blocks
+	int width = src_width < dst_width ? src_width : dst_width;
+	int height = src_height < dst_height ? src_height : dst_height;
+	// Source pixel at the top left corner of the buffer
+	int x0 = ((-x % src_width) + src_width) % src_width;
+	int y0 = ((-y % src_height) + src_height) % src_height;
+	v4si bg = unpack(background);
+	for (int row = 0; row < height; ++row) {
+		int sy = (y0 + row) % src_height;
+		const uint32_t *in = (const uint32_t *)
+			((const uint8_t *)src + sy * src_stride);
+		uint32_t *out = (uint32_t *)((uint8_t *)dst + row * dst_stride);
+		// Up to the source's right edge, then wrapping around to its left
+		for (int col = 0, sx = x0; col < width; sx = 0) {
+			int n = src_width - sx < width - col ? src_width - sx : width - col;
+			const uint32_t *s = in + sx;
+			uint32_t *d = out + col;
+			if (src_alpha) {
+				for (int i = 0; i < n; ++i) {
+					d[i] = pack(over(unpack(s[i]), bg));
+				}
+			} else {
+				for (int i = 0; i < n; ++i) {
+					d[i] = s[i] | 0xff000000;
+				}
+			}
+			col += n;
+		}
+		for (int done = width; done < dst_width; done *= 2) {
+			int n = dst_width - done < done ? dst_width - done : done;
+			memcpy(out + done, out, n * sizeof(uint32_t));
+		}
+	}
+
+	size_t row_bytes = dst_width * sizeof(uint32_t);
+	if ((size_t)dst_stride != row_bytes) {
+		for (int y = height; y < dst_height; ++y) {
+			memcpy((uint8_t *)dst + y * dst_stride,
+				(uint8_t *)dst + (y - height) * dst_stride, row_bytes);
+		}
+		return;
+	}
+	for (int done = height; done < dst_height; done *= 2) {
+		int n = dst_height - done < done ? dst_height - done : done;
+		memcpy((uint8_t *)dst + (size_t)done * dst_stride, dst,
+			(size_t)n * dst_stride);
+	}
+}
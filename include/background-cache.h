@@ -0,0 +1,43 @@
+#ifndef _SWAYLOCK_BACKGROUND_CACHE_H
+#define _SWAYLOCK_BACKGROUND_CACHE_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "background-image.h"
+
+/**
+ * Rendered backgrounds are cached on disk as raw premultiplied ARGB32 pixels,
+ * so that locking with a known image and output needs neither decoding nor
+ * scaling.
+ */
+
+/**
+ * Returns the cache key for an image rendered with the given parameters, or
+ * NULL if the image file cannot be stat'ed. The key covers the image's path,
+ * modification time and size. The transform is the wl_output_transform the
+ * buffer is rendered in.
+ */
+char *background_cache_key(const char *path, int width, int height,
+		int transform, enum background_mode mode, uint32_t color,
+		enum image_filter filter, enum image_filter limit);
+
+/**
+ * Returns whether background_cache_load() would find an entry, without
+ * reading its pixels.
+ */
+bool background_cache_contains(const char *key, int width, int height,
+		int stride);
+
+/**
+ * Reads cached pixels into data and the rectangle of them known to be opaque
+ * into opaque. Returns false if there is no usable entry.
+ */
+bool background_cache_load(const char *key, void *data, int width,
+		int height, int stride, cairo_rectangle_int_t *opaque);
+
+/**
+ * Writes pixels to the cache, evicting old entries when it grows too large.
+ */
+void background_cache_store(const char *key, const void *data, int width,
+		int height, int stride, const cairo_rectangle_int_t *opaque);
+
+#endif
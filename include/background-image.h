@@ -1,6 +1,8 @@
 #ifndef _SWAY_BACKGROUND_IMAGE_H
 #define _SWAY_BACKGROUND_IMAGE_H
+#include <stdbool.h>
 #include "cairo.h"
+#include "image-scale.h"
 
 enum background_mode {
 	BACKGROUND_MODE_STRETCH,
@@ -13,8 +15,54 @@ enum background_mode {
 };
 
 enum background_mode parse_background_mode(const char *mode);
-cairo_surface_t *load_background_image(const char *path);
+enum image_filter parse_scaling_filter(const char *filter);
+/**
+ * Resolves IMAGE_FILTER_AUTO to the cheapest filter that renders the image
+ * without visible artifacts at its scale, but no better than limit. Other
+ * filters are returned as is.
+ */
+enum image_filter background_image_filter(enum image_filter filter,
+		enum image_filter limit, enum background_mode mode, int image_width,
+		int image_height, int buffer_width, int buffer_height);
+/**
+ * Returns the factor, at most 1, by which an image can be downscaled while
+ * still being rendered at full resolution onto a buffer of at most the given
+ * size, in either orientation.
+ */
+double background_image_scale(enum background_mode mode, int image_width,
+		int image_height, int buffer_width, int buffer_height);
+/**
+ * Loads the image, downscaled as far as background_image_scale() allows for
+ * buffers up to max_width x max_height. Pass 0 to load at full resolution.
+ * Sets downscaled if the image was loaded at a reduced size.
+ */
+cairo_surface_t *load_background_image(const char *path,
+		enum background_mode mode, int max_width, int max_height,
+		bool *downscaled);
+/**
+ * Renders the image onto the cairo context. Tiles are laid out with one of
+ * them at (tile_x, tile_y).
+ */
 void render_background_image(cairo_t *cairo, cairo_surface_t *image,
-		enum background_mode mode, int buffer_width, int buffer_height);
+		enum background_mode mode, int buffer_width, int buffer_height,
+		enum image_filter filter, int tile_x, int tile_y);
+/**
+ * Returns the buffer pixels fully covered by an opaque image rendered with
+ * render_background_image(), which may be empty.
+ */
+cairo_rectangle_int_t background_image_coverage(enum background_mode mode,
+		int image_width, int image_height, int buffer_width,
+		int buffer_height);
+/**
+ * Renders the image over the RGBA background color straight into ARGB32 pixel
+ * data, without going through cairo. Tiles are laid out with one of them at
+ * (tile_x, tile_y). Returns false if the mode is not supported or on
+ * allocation failure; the data must then be rendered with
+ * render_background_image().
+ */
+bool render_background_image_direct(uint32_t *data, int stride,
+		int buffer_width, int buffer_height, cairo_surface_t *image,
+		enum background_mode mode, uint32_t color, enum image_filter filter,
+		int tile_x, int tile_y);
 
 #endif
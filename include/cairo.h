@@ -14,8 +14,12 @@ cairo_subpixel_order_t to_cairo_subpixel_order(enum wl_output_subpixel subpixel)
 
 #if HAVE_GDK_PIXBUF
 
+/**
+ * Converts the pixbuf to a cairo image surface, applying the given EXIF
+ * orientation (1-8) in the same pass.
+ */
 cairo_surface_t* gdk_cairo_image_surface_create_from_pixbuf(
-		const GdkPixbuf *gdkbuf);
+		const GdkPixbuf *gdkbuf, int orientation);
 
 #endif // HAVE_GDK_PIXBUF
 
@@ -0,0 +1,39 @@
+#ifndef _SWAYLOCK_IMAGE_SCALE_H
+#define _SWAYLOCK_IMAGE_SCALE_H
+#include <stdbool.h>
+#include <stdint.h>
+
+enum image_filter {
+	IMAGE_FILTER_NEAREST,
+	IMAGE_FILTER_BILINEAR,
+	IMAGE_FILTER_GOOD, // box filter when downscaling, bilinear otherwise
+	IMAGE_FILTER_BEST, // tent filter when downscaling, bicubic otherwise
+	IMAGE_FILTER_AUTO, // chosen per background, see background_image_filter()
+	IMAGE_FILTER_INVALID,
+};
+
+/**
+ * Scales the premultiplied ARGB32 src image to the width x height rectangle
+ * at (x, y) of the dst buffer, which may extend beyond it, and composites it
+ * over the premultiplied ARGB32 background color. Pixels of dst outside the
+ * rectangle are set to the background color. The filter must not be
+ * IMAGE_FILTER_AUTO. Large images are scaled by several threads in
+ * horizontal bands. Strides are given in bytes.
+ *
+ * Returns false if memory could not be allocated, leaving dst undefined.
+ */
+bool image_scale(uint32_t *dst, int dst_stride, int dst_width, int dst_height,
+		const uint32_t *src, int src_stride, int src_width, int src_height,
+		bool src_alpha, double x, double y, double width, double height,
+		uint32_t background, enum image_filter filter);
+
+/**
+ * Fills the dst buffer with copies of the premultiplied ARGB32 src image,
+ * one of them with its top left corner at (x, y), composited over the
+ * premultiplied ARGB32 background color. Strides are given in bytes.
+ */
+void image_tile(uint32_t *dst, int dst_stride, int dst_width, int dst_height,
+		const uint32_t *src, int src_stride, int src_width, int src_height,
+		bool src_alpha, int x, int y, uint32_t background);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef _SWAYLOCK_PIXEL_CONVERT_H
+#define _SWAYLOCK_PIXEL_CONVERT_H
+#include <stdint.h>
+
+/**
+ * Converts a row of packed 8-bit RGB to native-endian XRGB32, as used by
+ * CAIRO_FORMAT_RGB24. The unused byte is set to zero.
+ */
+void pixel_convert_rgb_row(uint32_t *dst, const uint8_t *src, int width);
+
+/**
+ * Converts a row of packed 8-bit RGBA with straight alpha to native-endian
+ * premultiplied ARGB32, as used by CAIRO_FORMAT_ARGB32.
+ */
+void pixel_convert_rgba_row(uint32_t *dst, const uint8_t *src, int width);
+
+// Rows converted at a time before they are rotated into place
+#define PIXEL_ORIENT_BAND_ROWS 16
+
+/**
+ * Stores rows [y0, y0 + n) of a w x h image, held contiguously in rows, at
+ * the position given by the EXIF orientation (2-8) in dst, whose
+ * stride is given in pixels.
+ */
+void pixel_store_oriented_rows(uint32_t *dst, int dst_stride,
+		const uint32_t *rows, int w, int h, int y0, int n, int orientation);
+
+#endif
@@ -3,6 +3,7 @@
 #include <cairo/cairo.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 #include <wayland-client.h>
 
 struct pool_buffer {
@@ -12,13 +13,62 @@ struct pool_buffer {
 	uint32_t width, height;
 	void *data;
 	size_t size;
+	uint32_t format;
 	bool busy;
+	struct wl_shm_pool *pool; // set for buffers created by create_buffer()
+	struct buffer_ring *ring; // set if the memory belongs to a ring's pool
+	size_t offset; // within the ring's pool
+	// What was last rendered into the buffer, so that a later frame can
+	// repaint only what changed. A freshly created buffer is all zeroes,
+	// which callers treat as serial 0.
+	uint32_t serial;
+	cairo_rectangle_int_t overdraw; // area painted on top of that content
+	struct timespec last_used;
+	struct wl_list link; // buffer_ring::buffers
+};
+
+/**
+ * A set of buffers for a surface that is redrawn often. It starts out with
+ * min_buffers buffers, grows when all of them are held by the compositor
+ * (up to max_buffers) and drops buffers again after they sat unused for a
+ * while.
+ *
+ * All buffers of a ring are carved out of a single shared memory pool, so
+ * that buffers changing size reuse the same memory. The pool's size only ever
+ * grows; the pages of dropped buffers are returned by punching holes into
+ * it, where the shm file supports that (memfd on Linux).
+ */
+struct buffer_ring {
+	struct wl_list buffers; // pool_buffer::link, most recently used first
+	size_t count;
+	size_t min_buffers, max_buffers;
+
+	int fd;
+	struct wl_shm_pool *pool;
+	void *data;
+	size_t capacity;
+	size_t high_water; // memory past this offset was never handed out
+
+	// Statistics
+	uint64_t starved; // requests that found every buffer busy
+	uint64_t reused; // requests served by an existing buffer
+	uint64_t allocated; // buffers (re)allocated
 };
 
 struct pool_buffer *create_buffer(struct wl_shm *shm, struct pool_buffer *buf,
 	int32_t width, int32_t height, uint32_t format);
-struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-	struct pool_buffer pool[static 2], uint32_t width, uint32_t height);
+/**
+ * Switches a buffer from create_buffer(), which must not be attached yet, to
+ * another 32-bit format over the same memory, e.g. to XRGB8888 once its
+ * content turns out to be opaque.
+ */
+void buffer_set_format(struct pool_buffer *buffer, uint32_t format);
 void destroy_buffer(struct pool_buffer *buffer);
 
+void buffer_ring_init(struct buffer_ring *ring, size_t min_buffers,
+	size_t max_buffers);
+struct pool_buffer *get_next_buffer(struct wl_shm *shm,
+	struct buffer_ring *ring, uint32_t width, uint32_t height);
+void buffer_ring_finish(struct buffer_ring *ring);
+
 #endif
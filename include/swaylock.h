@@ -1,5 +1,6 @@
 #ifndef _SWAYLOCK_H
 #define _SWAYLOCK_H
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <wayland-client.h>
@@ -69,6 +70,11 @@ struct swaylock_args {
 	bool daemonize;
 	int ready_fd;
 	bool indicator_idle_visible;
+	bool progressive_image;
+	enum image_filter scaling_filter;
+	// Reduced background resolution, upscaled by the compositor
+	int background_divisor; // 1 for full resolution
+	uint64_t background_pixel_budget; // per output, 0 for none
 };
 
 struct swaylock_password {
@@ -86,13 +92,16 @@ struct swaylock_state {
 	struct wl_compositor *compositor;
 	struct wl_subcompositor *subcompositor;
 	struct wl_shm *shm;
+	bool shm_xrgb8888; // advertised by wl_shm, for opaque backgrounds
+	struct wp_viewporter *viewporter; // optional
+	struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager; // optional
+	struct wp_fractional_scale_manager_v1 *fractional_scale_manager; // optional
 	struct wl_list surfaces;
 	struct wl_list images;
+	struct wl_list backgrounds; // swaylock_background::link, MRU first
 	struct swaylock_args args;
 	struct swaylock_password password;
 	struct swaylock_xkb xkb;
-	cairo_surface_t *test_surface;
-	cairo_t *test_cairo; // used to estimate font/text sizes
 	enum auth_state auth_state; // state of the authentication attempt
 	enum input_state input_state; // state of the password buffer and key inputs
 	uint32_t highlight_start; // position of highlight; 2048 = 1 full turn
@@ -102,42 +111,170 @@ struct swaylock_state {
 	struct ext_session_lock_v1 *ext_session_lock_v1;
 };
 
+// A rendered background, shared by all surfaces that would show identical
+// pixels, e.g. outputs with the same resolution and image. Until the session
+// is locked a few unused ones are kept around, so that outputs settling on a
+// scale or mode they had before only need to attach the buffer again.
+struct swaylock_background {
+	struct swaylock_state *state;
+	struct pool_buffer buffer;
+	struct swaylock_image *image; // NULL for a plain background color
+	char *cache_key; // set while the pixels are not in the disk cache yet
+	// Set while a thread may still be writing the pixels to the disk cache
+	bool storing;
+	pthread_t store_thread;
+	bool opaque; // every pixel is
+	cairo_rectangle_int_t opaque_box; // pixels known to be opaque
+	enum background_mode mode;
+	uint32_t color;
+	// Requested filter and, for IMAGE_FILTER_AUTO, the output's limit
+	enum image_filter filter, filter_limit;
+	enum wl_output_transform transform; // width and height are after it
+	int width, height;
+	int refs;
+	struct wl_list link; // swaylock_state::backgrounds
+};
+
+// A string converted to glyphs with the scaled font of a swaylock_font_cache
+struct swaylock_text_run {
+	char *text;
+	cairo_glyph_t *glyphs;
+	int num_glyphs;
+	cairo_text_extents_t extents;
+	struct wl_list link; // swaylock_font_cache::runs
+};
+
+// Indicator font set up for one surface, along with the strings recently
+// drawn with it, so that text is neither re-configured nor re-measured on
+// every frame
+struct swaylock_font_cache {
+	cairo_scaled_font_t *scaled_font;
+	cairo_font_extents_t extents;
+	double size;
+	double scale;
+	enum wl_output_subpixel subpixel;
+	struct wl_list runs; // swaylock_text_run::link, most recently used first
+	int num_runs;
+};
+
+// Pre-rendered static layers of the indicator. A keystroke only moves the
+// highlight, so it can be composited on top of these instead of redrawing
+// everything from scratch.
+struct swaylock_indicator_cache {
+	cairo_surface_t *base; // inside, ring, message and layout box
+	cairo_surface_t *overlay; // inner and outer border lines
+	uint32_t serial; // changes every time the layers are re-rendered
+	cairo_rectangle_int_t text_box, layout_box; // in buffer coordinates
+	enum auth_state auth_state;
+	bool cleared; // input_state == INPUT_STATE_CLEAR
+	bool caps_lock;
+	char *text;
+	char *layout_text;
+	double scale;
+	enum wl_output_subpixel subpixel;
+	int width, height;
+};
+
 struct swaylock_surface {
-	cairo_surface_t *image;
+	struct swaylock_image *image;
 	struct swaylock_state *state;
 	struct wl_output *output;
 	uint32_t output_global_name;
 	struct wl_surface *surface; // surface for background
 	struct wl_surface *child; // indicator surface made into subsurface
 	struct wl_subsurface *subsurface;
+	struct wp_viewport *viewport, *child_viewport; // NULL without wp_viewporter
+	struct wp_fractional_scale_v1 *wp_fractional_scale; // needs wp_viewporter
 	struct ext_session_lock_surface_v1 *ext_session_lock_surface_v1;
-	struct pool_buffer indicator_buffers[2];
+	struct buffer_ring indicator_buffers;
+	struct swaylock_indicator_cache indicator_cache;
+	struct swaylock_font_cache font_cache;
+	// Content of the last indicator frame committed, for damage tracking
+	uint32_t indicator_serial;
+	cairo_rectangle_int_t indicator_overdraw;
+	int indicator_width, indicator_height;
 	bool created;
 	bool frame_pending, dirty;
 	uint32_t width, height;
 	int32_t scale;
+	uint32_t fractional_scale; // preferred scale in 120ths, 0 if unknown
+	int32_t mode_width, mode_height; // current wl_output mode, in pixels
+	int32_t mode_refresh; // in mHz, 0 if unknown
+	// Best filter --scaling-filter=auto may use, lowered whenever rendering
+	// the background takes longer than a frame
+	enum image_filter filter_limit;
 	enum wl_output_subpixel subpixel;
+	// Buffers are rendered in the output's native orientation
+	enum wl_output_transform transform;
 	char *output_name;
 	struct wl_list link;
-	// Dimensions of last wl_buffer committed to background surface
-	int last_buffer_width, last_buffer_height;
+	// Background last committed to the surface
+	struct swaylock_background *background;
+	// Viewport destinations last set, 0x0 if unset
+	uint32_t viewport_width, viewport_height;
+	uint32_t child_viewport_width, child_viewport_height;
 };
 
 // There is exactly one swaylock_image for each -i argument
 struct swaylock_image {
+	struct swaylock_state *state;
 	char *path;
 	char *output_name;
-	cairo_surface_t *cairo_surface;
+	cairo_surface_t *cairo_surface; // NULL until an output needs the image
+	bool load_failed;
+	// Largest buffer the image is decoded for, 0 for full resolution
+	int max_width, max_height;
+	bool downscaled;
+	// Set while a worker thread decodes the image; the fields above are
+	// owned by that thread until it is joined in load_image_surface()
+	bool decoding;
+	pthread_t thread;
 	struct wl_list link;
 };
 
 void swaylock_handle_key(struct swaylock_state *state,
 		xkb_keysym_t keysym, uint32_t codepoint);
 void render_frame_background(struct swaylock_surface *surface);
+/**
+ * Returns the factor, at most 1, by which a background of the given size in
+ * device pixels is reduced to follow --background-resolution.
+ */
+double get_background_resolution(struct swaylock_state *state,
+		double width, double height);
 void render_frame(struct swaylock_surface *surface);
+/**
+ * Gets the size of the buffer for the surface's image background, in the
+ * output's native orientation, and whether the viewport maps it onto the
+ * surface. Until the surface is configured and its fractional scale is known,
+ * the size is derived from the output's mode. Returns false if neither is
+ * known yet.
+ */
+bool get_background_size(struct swaylock_surface *surface,
+		int *width, int *height, bool *viewported);
+/**
+ * Returns whether the surface's background with the image can most likely be
+ * loaded from the disk cache, judging by get_background_size().
+ */
+bool background_is_cached(struct swaylock_surface *surface,
+		struct swaylock_image *image);
+void unref_background(struct swaylock_background *background);
+// Frees the backgrounds no surface shows anymore
+void release_unused_backgrounds(struct swaylock_state *state);
+/**
+ * Starts writing backgrounds that are not in the disk cache yet to it, each
+ * on its own thread.
+ */
+void store_backgrounds(struct swaylock_state *state);
+// Waits for the threads started by store_backgrounds()
+void finish_background_stores(struct swaylock_state *state);
+cairo_surface_t *load_image_surface(struct swaylock_image *image,
+		int buffer_width, int buffer_height);
+void destroy_indicator_cache(struct swaylock_indicator_cache *cache);
+void destroy_font_cache(struct swaylock_font_cache *cache);
 void damage_surface(struct swaylock_surface *surface);
 void damage_state(struct swaylock_state *state);
 void clear_password_buffer(struct swaylock_password *pw);
+int lenient_strcmp(const char *a, const char *b);
 void schedule_auth_idle(struct swaylock_state *state);
 
 void initialize_pw_backend(int argc, char **argv);
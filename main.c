@@ -4,7 +4,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <math.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -26,6 +29,13 @@
 #include "seat.h"
 #include "swaylock.h"
 #include "ext-session-lock-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
+#if HAVE_FRACTIONAL_SCALE
+#include "fractional-scale-v1-client-protocol.h"
+#endif
+#if HAVE_SINGLE_PIXEL_BUFFER
+#include "single-pixel-buffer-v1-client-protocol.h"
+#endif
 
 static uint32_t parse_color(const char *color) {
 	if (color[0] == '#') {
@@ -45,7 +55,49 @@ static uint32_t parse_color(const char *color) {
 	return res;
 }
 
-int lenient_strcmp(char *a, char *b) {
+// Parses a decimal number without sign or blanks, 0 if there is none or it
+// does not fit
+static unsigned long long parse_positive(const char *str, char **end) {
+	*end = (char *)str;
+	if (!isdigit((unsigned char)str[0])) {
+		return 0;
+	}
+	errno = 0;
+	unsigned long long value = strtoull(str, end, 10);
+	return errno == ERANGE ? 0 : value;
+}
+
+static bool parse_background_resolution(const char *res,
+		struct swaylock_args *args) {
+	args->background_divisor = 1;
+	args->background_pixel_budget = 0;
+	if (strcmp(res, "full") == 0) {
+		return true;
+	} else if (strcmp(res, "half") == 0) {
+		args->background_divisor = 2;
+		return true;
+	}
+
+	// A pixel count, or a size whose area is the budget
+	char *end;
+	unsigned long long pixels = parse_positive(res, &end);
+	if (pixels && *end == 'x') {
+		unsigned long long height = parse_positive(end + 1, &end);
+		if (height > ULLONG_MAX / pixels) {
+			pixels = 0;
+		}
+		pixels *= height;
+	}
+	if (pixels == 0 || *end != '\0') {
+		swaylock_log(LOG_ERROR, "Invalid background resolution %s, expected "
+				"full, half, <pixels> or <width>x<height>", res);
+		return false;
+	}
+	args->background_pixel_budget = pixels;
+	return true;
+}
+
+int lenient_strcmp(const char *a, const char *b) {
 	if (a == b) {
 		return 0;
 	} else if (!a) {
@@ -100,30 +152,64 @@ static void destroy_surface(struct swaylock_surface *surface) {
 	if (surface->subsurface) {
 		wl_subsurface_destroy(surface->subsurface);
 	}
+#if HAVE_FRACTIONAL_SCALE
+	if (surface->wp_fractional_scale) {
+		wp_fractional_scale_v1_destroy(surface->wp_fractional_scale);
+	}
+#endif
+	if (surface->viewport) {
+		wp_viewport_destroy(surface->viewport);
+	}
+	if (surface->child_viewport) {
+		wp_viewport_destroy(surface->child_viewport);
+	}
 	if (surface->child) {
 		wl_surface_destroy(surface->child);
 	}
 	if (surface->surface != NULL) {
 		wl_surface_destroy(surface->surface);
 	}
-	destroy_buffer(&surface->indicator_buffers[0]);
-	destroy_buffer(&surface->indicator_buffers[1]);
+	struct buffer_ring *ring = &surface->indicator_buffers;
+	swaylock_log(LOG_DEBUG, "Indicator buffers for output %s: %zu allocated, "
+			"%zu reused, %zu requests starved",
+			surface->output_name ? surface->output_name : "?",
+			(size_t)ring->allocated, (size_t)ring->reused, (size_t)ring->starved);
+	buffer_ring_finish(ring);
+	destroy_indicator_cache(&surface->indicator_cache);
+	destroy_font_cache(&surface->font_cache);
+	if (surface->background) {
+		unref_background(surface->background);
+	}
 	wl_output_release(surface->output);
 	free(surface);
 }
 
 static const struct ext_session_lock_surface_v1_listener ext_session_lock_surface_v1_listener;
 
-static cairo_surface_t *select_image(struct swaylock_state *state,
+static struct swaylock_image *select_image(struct swaylock_state *state,
 		struct swaylock_surface *surface);
+static void start_image_decode(struct swaylock_state *state,
+		struct swaylock_image *image);
 
-static bool surface_is_opaque(struct swaylock_surface *surface) {
-	if (surface->image) {
-		return cairo_surface_get_content(surface->image) == CAIRO_CONTENT_COLOR;
+#if HAVE_FRACTIONAL_SCALE
+static void handle_preferred_scale(void *data,
+		struct wp_fractional_scale_v1 *fractional_scale, uint32_t scale) {
+	struct swaylock_surface *surface = data;
+	if (surface->fractional_scale == scale) {
+		return;
+	}
+	surface->fractional_scale = scale;
+	if (surface->state->run_display) {
+		render_frame_background(surface);
+		damage_surface(surface);
 	}
-	return (surface->state->args.colors.background & 0xff) == 0xff;
 }
 
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+	.preferred_scale = handle_preferred_scale,
+};
+#endif
+
 static void create_surface(struct swaylock_surface *surface) {
 	struct swaylock_state *state = surface->state;
 
@@ -131,11 +217,28 @@ static void create_surface(struct swaylock_surface *surface) {
 
 	surface->surface = wl_compositor_create_surface(state->compositor);
 	assert(surface->surface);
+	if (state->viewporter) {
+		surface->viewport =
+			wp_viewporter_get_viewport(state->viewporter, surface->surface);
+	}
+#if HAVE_FRACTIONAL_SCALE
+	if (state->viewporter && state->fractional_scale_manager) {
+		surface->wp_fractional_scale =
+			wp_fractional_scale_manager_v1_get_fractional_scale(
+				state->fractional_scale_manager, surface->surface);
+		wp_fractional_scale_v1_add_listener(surface->wp_fractional_scale,
+			&fractional_scale_listener, surface);
+	}
+#endif
 
 	surface->child = wl_compositor_create_surface(state->compositor);
 	assert(surface->child);
 	surface->subsurface = wl_subcompositor_get_subsurface(state->subcompositor, surface->child, surface->surface);
 	assert(surface->subsurface);
+	if (state->viewporter) {
+		surface->child_viewport =
+			wp_viewporter_get_viewport(state->viewporter, surface->child);
+	}
 	wl_subsurface_set_sync(surface->subsurface);
 
 	surface->ext_session_lock_surface_v1 = ext_session_lock_v1_get_lock_surface(
@@ -143,16 +246,6 @@ static void create_surface(struct swaylock_surface *surface) {
 	ext_session_lock_surface_v1_add_listener(surface->ext_session_lock_surface_v1,
 		&ext_session_lock_surface_v1_listener, surface);
 
-	if (surface_is_opaque(surface) &&
-			surface->state->args.mode != BACKGROUND_MODE_CENTER &&
-			surface->state->args.mode != BACKGROUND_MODE_FIT) {
-		struct wl_region *region =
-			wl_compositor_create_region(surface->state->compositor);
-		wl_region_add(region, 0, 0, INT32_MAX, INT32_MAX);
-		wl_surface_set_opaque_region(surface->surface, region);
-		wl_region_destroy(region);
-	}
-
 	surface->created = true;
 }
 
@@ -186,8 +279,8 @@ static void surface_frame_handle_done(void *data, struct wl_callback *callback,
 		wl_callback_add_listener(callback, &surface_frame_listener, surface);
 		surface->frame_pending = true;
 
-		render_frame(surface);
 		surface->dirty = false;
+		render_frame(surface);
 	}
 }
 
@@ -225,6 +318,19 @@ static void handle_wl_output_geometry(void *data, struct wl_output *wl_output,
 		int32_t transform) {
 	struct swaylock_surface *surface = data;
 	surface->subpixel = subpixel;
+	if (transform < WL_OUTPUT_TRANSFORM_NORMAL ||
+			transform > WL_OUTPUT_TRANSFORM_FLIPPED_270) {
+		transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	}
+	if (surface->transform != (enum wl_output_transform)transform) {
+		surface->transform = transform;
+		// The indicator buffers hold frames in the old orientation; new
+		// layers come with a new serial, which keeps them from being reused
+		destroy_indicator_cache(&surface->indicator_cache);
+		if (surface->state->run_display) {
+			render_frame_background(surface);
+		}
+	}
 	if (surface->state->run_display) {
 		damage_surface(surface);
 	}
@@ -232,11 +338,26 @@ static void handle_wl_output_geometry(void *data, struct wl_output *wl_output,
 
 static void handle_wl_output_mode(void *data, struct wl_output *output,
 		uint32_t flags, int32_t width, int32_t height, int32_t refresh) {
-	// Who cares
+	struct swaylock_surface *surface = data;
+	if (flags & WL_OUTPUT_MODE_CURRENT) {
+		surface->mode_width = width;
+		surface->mode_height = height;
+		surface->mode_refresh = refresh;
+	}
 }
 
 static void handle_wl_output_done(void *data, struct wl_output *output) {
 	struct swaylock_surface *surface = data;
+	struct swaylock_state *state = surface->state;
+	if (!surface->created && state->run_display &&
+			state->args.mode != BACKGROUND_MODE_SOLID_COLOR) {
+		// Decode the image for a hotplugged output while its surface is
+		// configured. Outputs present at startup are handled in main().
+		struct swaylock_image *image = select_image(state, surface);
+		if (image) {
+			start_image_decode(state, image);
+		}
+	}
 	if (!surface->created && surface->state->run_display) {
 		create_surface(surface);
 	}
@@ -274,6 +395,8 @@ struct wl_output_listener _wl_output_listener = {
 static void ext_session_lock_v1_handle_locked(void *data, struct ext_session_lock_v1 *lock) {
 	struct swaylock_state *state = data;
 	state->locked = true;
+	// Every output is configured, leftovers from earlier modes can go
+	release_unused_backgrounds(state);
 }
 
 static void ext_session_lock_v1_handle_finished(void *data, struct ext_session_lock_v1 *lock) {
@@ -287,6 +410,23 @@ static const struct ext_session_lock_v1_listener ext_session_lock_v1_listener =
 	.finished = ext_session_lock_v1_handle_finished,
 };
 
+// The indicator starts double-buffered and grows up to INDICATOR_BUFFERS_MAX
+// buffers when the compositor is slow to release them
+#define INDICATOR_BUFFERS_MIN 2
+#define INDICATOR_BUFFERS_MAX 4
+
+static void handle_shm_format(void *data, struct wl_shm *shm,
+		uint32_t format) {
+	struct swaylock_state *state = data;
+	if (format == WL_SHM_FORMAT_XRGB8888) {
+		state->shm_xrgb8888 = true;
+	}
+}
+
+static const struct wl_shm_listener shm_listener = {
+	.format = handle_shm_format,
+};
+
 static void handle_global(void *data, struct wl_registry *registry,
 		uint32_t name, const char *interface, uint32_t version) {
 	struct swaylock_state *state = data;
@@ -299,6 +439,7 @@ static void handle_global(void *data, struct wl_registry *registry,
 	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
 		state->shm = wl_registry_bind(registry, name,
 				&wl_shm_interface, 1);
+		wl_shm_add_listener(state->shm, &shm_listener, state);
 	} else if (strcmp(interface, wl_seat_interface.name) == 0) {
 		struct wl_seat *seat = wl_registry_bind(
 				registry, name, &wl_seat_interface, 4);
@@ -310,6 +451,9 @@ static void handle_global(void *data, struct wl_registry *registry,
 		struct swaylock_surface *surface =
 			calloc(1, sizeof(struct swaylock_surface));
 		surface->state = state;
+		surface->filter_limit = IMAGE_FILTER_GOOD;
+		buffer_ring_init(&surface->indicator_buffers,
+				INDICATOR_BUFFERS_MIN, INDICATOR_BUFFERS_MAX);
 		surface->output = wl_registry_bind(registry, name,
 				&wl_output_interface, 4);
 		surface->output_global_name = name;
@@ -318,6 +462,21 @@ static void handle_global(void *data, struct wl_registry *registry,
 	} else if (strcmp(interface, ext_session_lock_manager_v1_interface.name) == 0) {
 		state->ext_session_lock_manager_v1 = wl_registry_bind(registry, name,
 				&ext_session_lock_manager_v1_interface, 1);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		state->viewporter = wl_registry_bind(registry, name,
+				&wp_viewporter_interface, 1);
+#if HAVE_FRACTIONAL_SCALE
+	} else if (strcmp(interface,
+			wp_fractional_scale_manager_v1_interface.name) == 0) {
+		state->fractional_scale_manager = wl_registry_bind(registry, name,
+				&wp_fractional_scale_manager_v1_interface, 1);
+#endif
+#if HAVE_SINGLE_PIXEL_BUFFER
+	} else if (strcmp(interface,
+			wp_single_pixel_buffer_manager_v1_interface.name) == 0) {
+		state->single_pixel_buffer_manager = wl_registry_bind(registry, name,
+				&wp_single_pixel_buffer_manager_v1_interface, 1);
+#endif
 	}
 }
 
@@ -340,19 +499,21 @@ static const struct wl_registry_listener registry_listener = {
 
 static int sigusr_fds[2] = {-1, -1};
 
+static int image_ready_fds[2];
+
 void do_sigusr(int sig) {
 	(void)write(sigusr_fds[1], "1", 1);
 }
 
-static cairo_surface_t *select_image(struct swaylock_state *state,
+static struct swaylock_image *select_image(struct swaylock_state *state,
 		struct swaylock_surface *surface) {
 	struct swaylock_image *image;
-	cairo_surface_t *default_image = NULL;
+	struct swaylock_image *default_image = NULL;
 	wl_list_for_each(image, &state->images, link) {
 		if (lenient_strcmp(image->output_name, surface->output_name) == 0) {
-			return image->cairo_surface;
+			return image;
 		} else if (!image->output_name) {
-			default_image = image->cairo_surface;
+			default_image = image;
 		}
 	}
 	return default_image;
@@ -378,6 +539,7 @@ static char *join_args(char **argv, int argc) {
 static void load_image(char *arg, struct swaylock_state *state) {
 	// [[<output>]:]<path>
 	struct swaylock_image *image = calloc(1, sizeof(struct swaylock_image));
+	image->state = state;
 	char *separator = strchr(arg, ':');
 	if (separator) {
 		*separator = '\0';
@@ -400,7 +562,9 @@ static void load_image(char *arg, struct swaylock_state *state) {
 						image->path);
 			}
 			wl_list_remove(&iter_image->link);
-			free(iter_image->cairo_surface);
+			if (iter_image->cairo_surface) {
+				cairo_surface_destroy(iter_image->cairo_surface);
+			}
 			free(iter_image->output_name);
 			free(iter_image->path);
 			free(iter_image);
@@ -424,17 +588,113 @@ static void load_image(char *arg, struct swaylock_state *state) {
 		wordfree(&p);
 	}
 
-	// Load the actual image
-	image->cairo_surface = load_background_image(image->path);
-	if (!image->cairo_surface) {
+	// The image is only decoded once an output actually shows it
+	if (access(image->path, R_OK) != 0) {
+		swaylock_log_errno(LOG_ERROR, "Cannot read image %s", image->path);
+		free(image->output_name);
+		free(image->path);
 		free(image);
 		return;
 	}
 	wl_list_insert(&state->images, &image->link);
-	swaylock_log(LOG_DEBUG, "Loaded image %s for output %s", image->path,
+	swaylock_log(LOG_DEBUG, "Using image %s for output %s", image->path,
 			image->output_name ? image->output_name : "*");
 }
 
+static void *decode_image(void *data) {
+	struct swaylock_image *image = data;
+	image->cairo_surface = load_background_image(image->path,
+		image->state->args.mode, image->max_width, image->max_height,
+		&image->downscaled);
+	image->load_failed = !image->cairo_surface;
+	if (image->cairo_surface) {
+		swaylock_log(LOG_DEBUG, "Loaded image %s for output %s", image->path,
+				image->output_name ? image->output_name : "*");
+	}
+	return NULL;
+}
+
+static void *decode_image_thread(void *data) {
+	decode_image(data);
+	// Let the main loop know that the thread is ready to be joined
+	(void)write(image_ready_fds[1], &data, sizeof(data));
+	return NULL;
+}
+
+static void start_image_decode(struct swaylock_state *state,
+		struct swaylock_image *image) {
+	// The running thread owns the other fields, don't look at them yet
+	if (image->decoding) {
+		return;
+	}
+	if (image->cairo_surface || image->load_failed) {
+		return;
+	}
+	// Decode for the largest output known to show the image. Outputs
+	// showing up later get the image decoded again if it is too small.
+	// Outputs whose background is in the disk cache don't need it at all.
+	bool needed = false;
+	struct swaylock_surface *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (select_image(state, surface) != image ||
+				background_is_cached(surface, image)) {
+			continue;
+		}
+		needed = true;
+		int width, height;
+		bool viewported;
+		if (get_background_size(surface, &width, &height, &viewported)) {
+			if (width > image->max_width) {
+				image->max_width = width;
+			}
+			if (height > image->max_height) {
+				image->max_height = height;
+			}
+		}
+	}
+	if (!needed) {
+		return;
+	}
+	int err = pthread_create(&image->thread, NULL, decode_image_thread, image);
+	if (err != 0) {
+		// load_image_surface() decodes synchronously instead
+		swaylock_log(LOG_ERROR, "Failed to start decoding %s: %s",
+				image->path, strerror(err));
+		return;
+	}
+	image->decoding = true;
+}
+
+cairo_surface_t *load_image_surface(struct swaylock_image *image,
+		int buffer_width, int buffer_height) {
+	if (image->decoding) {
+		pthread_join(image->thread, NULL);
+		image->decoding = false;
+	}
+	// The decoded size does not depend on the orientation of the buffer
+	bool fits = (buffer_width <= image->max_width &&
+			buffer_height <= image->max_height) ||
+		(buffer_width <= image->max_height &&
+			buffer_height <= image->max_width);
+	if (image->cairo_surface && image->downscaled && !fits) {
+		swaylock_log(LOG_DEBUG, "Image %s was decoded for %dx%d, "
+				"reloading it for %dx%d", image->path, image->max_width,
+				image->max_height, buffer_width, buffer_height);
+		cairo_surface_destroy(image->cairo_surface);
+		image->cairo_surface = NULL;
+	}
+	if (!image->cairo_surface && !image->load_failed) {
+		if (buffer_width > image->max_width) {
+			image->max_width = buffer_width;
+		}
+		if (buffer_height > image->max_height) {
+			image->max_height = buffer_height;
+		}
+		decode_image(image);
+	}
+	return image->cairo_surface;
+}
+
 static void set_default_colors(struct swaylock_colors *colors) {
 	colors->background = 0xFFFFFFFF;
 	colors->bs_highlight = 0xDB3300FF;
@@ -484,7 +744,8 @@ enum line_mode {
 static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		enum line_mode *line_mode, char **config_path) {
 	enum long_option_codes {
-		LO_BS_HL_COLOR = 256,
+		LO_BACKGROUND_RESOLUTION = 256,
+		LO_BS_HL_COLOR,
 		LO_CAPS_LOCK_BS_HL_COLOR,
 		LO_CAPS_LOCK_KEY_HL_COLOR,
 		LO_FONT,
@@ -508,11 +769,13 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		LO_LINE_CAPS_LOCK_COLOR,
 		LO_LINE_VER_COLOR,
 		LO_LINE_WRONG_COLOR,
+		LO_PROGRESSIVE_IMAGE,
 		LO_RING_COLOR,
 		LO_RING_CLEAR_COLOR,
 		LO_RING_CAPS_LOCK_COLOR,
 		LO_RING_VER_COLOR,
 		LO_RING_WRONG_COLOR,
+		LO_SCALING_FILTER,
 		LO_SEP_COLOR,
 		LO_TEXT_COLOR,
 		LO_TEXT_CLEAR_COLOR,
@@ -541,6 +804,7 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		{"hide-keyboard-layout", no_argument, NULL, 'K'},
 		{"show-failed-attempts", no_argument, NULL, 'F'},
 		{"version", no_argument, NULL, 'v'},
+		{"background-resolution", required_argument, NULL, LO_BACKGROUND_RESOLUTION},
 		{"bs-hl-color", required_argument, NULL, LO_BS_HL_COLOR},
 		{"caps-lock-bs-hl-color", required_argument, NULL, LO_CAPS_LOCK_BS_HL_COLOR},
 		{"caps-lock-key-hl-color", required_argument, NULL, LO_CAPS_LOCK_KEY_HL_COLOR},
@@ -565,11 +829,13 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		{"line-caps-lock-color", required_argument, NULL, LO_LINE_CAPS_LOCK_COLOR},
 		{"line-ver-color", required_argument, NULL, LO_LINE_VER_COLOR},
 		{"line-wrong-color", required_argument, NULL, LO_LINE_WRONG_COLOR},
+		{"progressive-image", no_argument, NULL, LO_PROGRESSIVE_IMAGE},
 		{"ring-color", required_argument, NULL, LO_RING_COLOR},
 		{"ring-clear-color", required_argument, NULL, LO_RING_CLEAR_COLOR},
 		{"ring-caps-lock-color", required_argument, NULL, LO_RING_CAPS_LOCK_COLOR},
 		{"ring-ver-color", required_argument, NULL, LO_RING_VER_COLOR},
 		{"ring-wrong-color", required_argument, NULL, LO_RING_WRONG_COLOR},
+		{"scaling-filter", required_argument, NULL, LO_SCALING_FILTER},
 		{"separator-color", required_argument, NULL, LO_SEP_COLOR},
 		{"text-color", required_argument, NULL, LO_TEXT_COLOR},
 		{"text-clear-color", required_argument, NULL, LO_TEXT_CLEAR_COLOR},
@@ -616,6 +882,9 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 			"Disable the unlock indicator.\n"
 		"  -v, --version                    "
 			"Show the version number and quit.\n"
+		"  --background-resolution <res>    "
+			"Background resolution: full, half, or at most <pixels> or "
+			"<width>x<height> pixels per output.\n"
 		"  --bs-hl-color <color>            "
 			"Sets the color of backspace highlight segments.\n"
 		"  --caps-lock-bs-hl-color <color>  "
@@ -675,6 +944,9 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 			"Use the inside color for the line between the inside and ring.\n"
 		"  -r, --line-uses-ring             "
 			"Use the ring color for the line between the inside and ring.\n"
+		"  --progressive-image              "
+			"Lock with the background color and show the image once it "
+			"is decoded.\n"
 		"  --ring-color <color>             "
 			"Sets the color of the ring of the indicator.\n"
 		"  --ring-clear-color <color>       "
@@ -686,6 +958,8 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 			"Sets the color of the ring of the indicator when verifying.\n"
 		"  --ring-wrong-color <color>       "
 			"Sets the color of the ring of the indicator when invalid.\n"
+		"  --scaling-filter <filter>        "
+			"Image scaling filter: nearest, bilinear, good, best, auto.\n"
 		"  --separator-color <color>        "
 			"Sets the color of the lines that separate highlight segments.\n"
 		"  --text-color <color>             "
@@ -801,6 +1075,11 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 			fprintf(stdout, "swaylock version " SWAYLOCK_VERSION "\n");
 			exit(EXIT_SUCCESS);
 			break;
+		case LO_BACKGROUND_RESOLUTION:
+			if (state && !parse_background_resolution(optarg, &state->args)) {
+				return 1;
+			}
+			break;
 		case LO_BS_HL_COLOR:
 			if (state) {
 				state->args.colors.bs_highlight = parse_color(optarg);
@@ -924,6 +1203,11 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 				state->args.colors.line.wrong = parse_color(optarg);
 			}
 			break;
+		case LO_PROGRESSIVE_IMAGE:
+			if (state) {
+				state->args.progressive_image = true;
+			}
+			break;
 		case LO_RING_COLOR:
 			if (state) {
 				state->args.colors.ring.input = parse_color(optarg);
@@ -949,6 +1233,14 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 				state->args.colors.ring.wrong = parse_color(optarg);
 			}
 			break;
+		case LO_SCALING_FILTER:
+			if (state) {
+				state->args.scaling_filter = parse_scaling_filter(optarg);
+				if (state->args.scaling_filter == IMAGE_FILTER_INVALID) {
+					return 1;
+				}
+			}
+			break;
 		case LO_SEP_COLOR:
 			if (state) {
 				state->args.colors.separator = parse_color(optarg);
@@ -1088,6 +1380,31 @@ static void term_in(int fd, short mask, void *data) {
 	state.run_display = false;
 }
 
+// Joins the image's decode thread and shows the image on the outputs that
+// have been standing in with the background color
+static void finish_image_decode(struct swaylock_image *image) {
+	if (!image->decoding) {
+		return; // already joined by a blocking render
+	}
+	if (!load_image_surface(image, 0, 0)) {
+		return; // keep showing the background color
+	}
+	struct swaylock_surface *surface;
+	wl_list_for_each(surface, &state.surfaces, link) {
+		if (surface->image == image && surface->background &&
+				surface->background->image != image) {
+			render_frame_background(surface);
+		}
+	}
+}
+
+static void image_ready_in(int fd, short mask, void *data) {
+	struct swaylock_image *image;
+	while (read(fd, &image, sizeof(image)) == sizeof(image)) {
+		finish_image_decode(image);
+	}
+}
+
 // Check for --debug 'early' we also apply the correct loglevel
 // to the forked child, without having to first proces all of the
 // configuration (including from file) before forking and (in the
@@ -1139,9 +1456,14 @@ int main(int argc, char **argv) {
 		.hide_keyboard_layout = false,
 		.show_failed_attempts = false,
 		.indicator_idle_visible = false,
+		.progressive_image = false,
+		.scaling_filter = IMAGE_FILTER_AUTO,
+		.background_divisor = 1,
+		.background_pixel_budget = 0,
 		.ready_fd = -1,
 	};
 	wl_list_init(&state.images);
+	wl_list_init(&state.backgrounds);
 	set_default_colors(&state.args.colors);
 
 	char *config_path = NULL;
@@ -1195,6 +1517,15 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
+	if (pipe(image_ready_fds) != 0) {
+		swaylock_log(LOG_ERROR, "Failed to pipe");
+		return EXIT_FAILURE;
+	}
+	if (fcntl(image_ready_fds[0], F_SETFL, O_NONBLOCK) == -1) {
+		swaylock_log(LOG_ERROR, "Failed to make pipe end nonblocking");
+		return EXIT_FAILURE;
+	}
+
 	wl_list_init(&state.surfaces);
 	state.xkb.context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
 	state.display = wl_display_connect(NULL);
@@ -1243,8 +1574,15 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	state.test_surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, 1, 1);
-	state.test_cairo = cairo_create(state.test_surface);
+	// Decode the images while the session is being locked. Every output's
+	// mode is known by now, so each image is decoded once, for the largest
+	// output showing it.
+	if (state.args.mode != BACKGROUND_MODE_SOLID_COLOR) {
+		struct swaylock_image *image;
+		wl_list_for_each(image, &state.images, link) {
+			start_image_decode(&state, image);
+		}
+	}
 
 	struct swaylock_surface *surface;
 	wl_list_for_each(surface, &state.surfaces, link) {
@@ -1267,6 +1605,13 @@ int main(int argc, char **argv) {
 		state.args.ready_fd = -1;
 	}
 	if (state.args.daemonize) {
+		// Only this thread survives the fork: a decode still running
+		// would never be joined in the child, and could leave cairo's or
+		// gdk-pixbuf's locks held there. Wait for all of them first.
+		struct swaylock_image *image;
+		wl_list_for_each(image, &state.images, link) {
+			finish_image_decode(image);
+		}
 		daemonize();
 	}
 
@@ -1277,12 +1622,19 @@ int main(int argc, char **argv) {
 
 	loop_add_fd(state.eventloop, sigusr_fds[0], POLLIN, term_in, NULL);
 
+	loop_add_fd(state.eventloop, image_ready_fds[0], POLLIN, image_ready_in,
+			NULL);
+
 	struct sigaction sa;
 	sa.sa_handler = do_sigusr;
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = SA_RESTART;
 	sigaction(SIGUSR1, &sa, NULL);
 
+	// Written only now, so that neither the disk I/O delays locking nor
+	// the writers are lost to the fork of daemonize()
+	store_backgrounds(&state);
+
 	state.run_display = true;
 	while (state.run_display) {
 		errno = 0;
@@ -1295,8 +1647,9 @@ int main(int argc, char **argv) {
 	ext_session_lock_v1_unlock_and_destroy(state.ext_session_lock_v1);
 	wl_display_roundtrip(state.display);
 
+	// Leave no partly written cache entries behind
+	finish_background_stores(&state);
+
 	free(state.args.font);
-	cairo_destroy(state.test_cairo);
-	cairo_surface_destroy(state.test_surface);
 	return 0;
 }
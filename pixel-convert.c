@@ -0,0 +1,246 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "log.h"
+#include "pixel-convert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_CONVERT_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define PIXEL_CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* premul-color = alpha/255 * color/255 * 255 = (alpha*color)/255
+ * (z/255) = z/256 * 256/255     = z/256 (1 + 1/255)
+ *         = z/256 + (z/256)/255 = (z + z/255)/256
+ *         # recurse once
+ *         = (z + (z + z/255)/256)/256
+ *         = (z + z/256 + z/256/255) / 256
+ *         # only use 16bit uint operations, loose some precision,
+ *         # result is floored.
+ *       ->  (z + z>>8)>>8
+ *         # add 0x80/255 = 0.5 to convert floor to round
+ *       =>  (z+0x80 + (z+0x80)>>8 ) >> 8
+ * ------
+ * tested as equal to lround(z/255.0) for uint z in [0..0xfe02]
+ *
+ * The vector kernels below compute exactly this in 16-bit lanes. The alpha
+ * channel is multiplied by 255, which the formula maps back onto itself.
+ */
+static inline uint32_t premul_alpha(uint32_t c, uint32_t a) {
+	uint32_t z = c * a + 0x80;
+	return (z + (z >> 8)) >> 8;
+}
+
+static void rgb_row_scalar(uint32_t *dst, const uint8_t *src, int width) {
+	for (int x = 0; x < width; ++x) {
+		dst[x] = (uint32_t)src[0] << 16 | (uint32_t)src[1] << 8 | src[2];
+		src += 3;
+	}
+}
+
+static void rgba_row_scalar(uint32_t *dst, const uint8_t *src, int width) {
+	for (int x = 0; x < width; ++x) {
+		uint32_t a = src[3];
+		dst[x] = a << 24 |
+			premul_alpha(src[0], a) << 16 |
+			premul_alpha(src[1], a) << 8 |
+			premul_alpha(src[2], a);
+		src += 4;
+	}
+}
+
+#ifdef PIXEL_CONVERT_X86
+// Premultiplies two RGBA pixels held in 16-bit lanes and reorders them to BGRA
+__attribute__((target("sse2")))
+static inline __m128i premul_sse2(__m128i p) {
+	const __m128i rgb = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+	const __m128i opaque = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+	__m128i a = _mm_shufflelo_epi16(p, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_or_si128(_mm_and_si128(a, rgb), opaque);
+	__m128i z = _mm_add_epi16(_mm_mullo_epi16(p, a), _mm_set1_epi16(0x80));
+	p = _mm_srli_epi16(_mm_add_epi16(z, _mm_srli_epi16(z, 8)), 8);
+	p = _mm_shufflelo_epi16(p, _MM_SHUFFLE(3, 0, 1, 2));
+	return _mm_shufflehi_epi16(p, _MM_SHUFFLE(3, 0, 1, 2));
+}
+
+__attribute__((target("sse2")))
+static void rgba_row_sse2(uint32_t *dst, const uint8_t *src, int width) {
+	const __m128i zero = _mm_setzero_si128();
+	int x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + 4 * x));
+		__m128i lo = premul_sse2(_mm_unpacklo_epi8(p, zero));
+		__m128i hi = premul_sse2(_mm_unpackhi_epi8(p, zero));
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+	}
+	rgba_row_scalar(dst + x, src + 4 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i premul_avx2(__m256i p) {
+	const __m256i rgb = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1,
+		0, -1, -1, -1, 0, -1, -1, -1);
+	const __m256i opaque = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0,
+		255, 0, 0, 0, 255, 0, 0, 0);
+	__m256i a = _mm256_shufflelo_epi16(p, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm256_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm256_or_si256(_mm256_and_si256(a, rgb), opaque);
+	__m256i z = _mm256_add_epi16(_mm256_mullo_epi16(p, a),
+		_mm256_set1_epi16(0x80));
+	p = _mm256_srli_epi16(_mm256_add_epi16(z, _mm256_srli_epi16(z, 8)), 8);
+	p = _mm256_shufflelo_epi16(p, _MM_SHUFFLE(3, 0, 1, 2));
+	return _mm256_shufflehi_epi16(p, _MM_SHUFFLE(3, 0, 1, 2));
+}
+
+__attribute__((target("avx2")))
+static void rgba_row_avx2(uint32_t *dst, const uint8_t *src, int width) {
+	const __m256i zero = _mm256_setzero_si256();
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)(src + 4 * x));
+		// Unpacking and packing both work within 128-bit lanes, so the
+		// pixel order is preserved
+		__m256i lo = premul_avx2(_mm256_unpacklo_epi8(p, zero));
+		__m256i hi = premul_avx2(_mm256_unpackhi_epi8(p, zero));
+		_mm256_storeu_si256((__m256i *)(dst + x),
+			_mm256_packus_epi16(lo, hi));
+	}
+	rgba_row_scalar(dst + x, src + 4 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void rgb_row_avx2(uint32_t *dst, const uint8_t *src, int width) {
+	// Spreads 4 RGB pixels per 128-bit lane into BGRX
+	const __m256i shuffle = _mm256_setr_epi8(
+		2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+		2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	int x = 0;
+	// Each iteration loads 28 bytes but only consumes 24
+	for (; x + 10 <= width; x += 8) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(src + 3 * x));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(src + 3 * x + 12));
+		__m256i p = _mm256_inserti128_si256(_mm256_castsi128_si256(lo),
+			hi, 1);
+		_mm256_storeu_si256((__m256i *)(dst + x),
+			_mm256_shuffle_epi8(p, shuffle));
+	}
+	rgb_row_scalar(dst + x, src + 3 * x, width - x);
+}
+#endif
+
+#ifdef PIXEL_CONVERT_NEON
+static inline uint8x16_t premul_neon(uint8x16_t c, uint8x16_t a) {
+	const uint16x8_t half = vdupq_n_u16(0x80);
+	uint16x8_t lo = vmlal_u8(half, vget_low_u8(c), vget_low_u8(a));
+	uint16x8_t hi = vmlal_u8(half, vget_high_u8(c), vget_high_u8(a));
+	return vcombine_u8(vshrn_n_u16(vsraq_n_u16(lo, lo, 8), 8),
+		vshrn_n_u16(vsraq_n_u16(hi, hi, 8), 8));
+}
+
+static void rgba_row_neon(uint32_t *dst, const uint8_t *src, int width) {
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x4_t p = vld4q_u8(src + 4 * x);
+		uint8x16x4_t out;
+		out.val[0] = premul_neon(p.val[2], p.val[3]);
+		out.val[1] = premul_neon(p.val[1], p.val[3]);
+		out.val[2] = premul_neon(p.val[0], p.val[3]);
+		out.val[3] = p.val[3];
+		vst4q_u8((uint8_t *)(dst + x), out);
+	}
+	rgba_row_scalar(dst + x, src + 4 * x, width - x);
+}
+
+static void rgb_row_neon(uint32_t *dst, const uint8_t *src, int width) {
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x3_t p = vld3q_u8(src + 3 * x);
+		uint8x16x4_t out;
+		out.val[0] = p.val[2];
+		out.val[1] = p.val[1];
+		out.val[2] = p.val[0];
+		out.val[3] = vdupq_n_u8(0);
+		vst4q_u8((uint8_t *)(dst + x), out);
+	}
+	rgb_row_scalar(dst + x, src + 3 * x, width - x);
+}
+#endif
+
+static void (*rgb_row)(uint32_t *dst, const uint8_t *src, int width) =
+	rgb_row_scalar;
+static void (*rgba_row)(uint32_t *dst, const uint8_t *src, int width) =
+	rgba_row_scalar;
+static pthread_once_t dispatch_once = PTHREAD_ONCE_INIT;
+
+static void init_dispatch(void) {
+	const char *name = "scalar";
+#ifdef PIXEL_CONVERT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		rgb_row = rgb_row_avx2;
+		rgba_row = rgba_row_avx2;
+		name = "AVX2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		rgba_row = rgba_row_sse2;
+		name = "SSE2";
+	}
+#elif defined(PIXEL_CONVERT_NEON)
+	rgb_row = rgb_row_neon;
+	rgba_row = rgba_row_neon;
+	name = "NEON";
+#endif
+	swaylock_log(LOG_DEBUG, "Using %s pixel conversion", name);
+}
+
+void pixel_convert_rgb_row(uint32_t *dst, const uint8_t *src, int width) {
+	pthread_once(&dispatch_once, init_dispatch);
+	rgb_row(dst, src, width);
+}
+
+void pixel_convert_rgba_row(uint32_t *dst, const uint8_t *src, int width) {
+	pthread_once(&dispatch_once, init_dispatch);
+	rgba_row(dst, src, width);
+}
+
+void pixel_store_oriented_rows(uint32_t *dst, int dst_stride,
+		const uint32_t *rows, int w, int h, int y0, int n, int orientation) {
+	switch (orientation) {
+	case 2: // flipped horizontally
+	case 3: // rotated by 180 degrees
+		for (int i = 0; i < n; ++i) {
+			int y = orientation == 2 ? y0 + i : h - 1 - (y0 + i);
+			uint32_t *d = dst + y * dst_stride + w - 1;
+			const uint32_t *s = rows + i * w;
+			for (int x = 0; x < w; ++x) {
+				*d-- = s[x];
+			}
+		}
+		break;
+	case 4: // flipped vertically
+		for (int i = 0; i < n; ++i) {
+			memcpy(dst + (h - 1 - (y0 + i)) * dst_stride, rows + i * w,
+				w * sizeof(uint32_t));
+		}
+		break;
+	case 5: // transposed
+	case 6: // rotated by 90 degrees clockwise
+	case 7: // transversed
+	case 8: // rotated by 90 degrees counter-clockwise
+		// Going down columns of the band keeps the writes to each
+		// destination row together
+		for (int x = 0; x < w; ++x) {
+			int dy = orientation == 5 || orientation == 6 ? x : w - 1 - x;
+			uint32_t *d = dst + dy * dst_stride;
+			for (int i = 0; i < n; ++i) {
+				int y = y0 + i;
+				int dx = orientation == 5 || orientation == 8 ? y : h - 1 - y;
+				d[dx] = rows[i * w + x];
+			}
+		}
+		break;
+	}
+}
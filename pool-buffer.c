@@ -1,4 +1,8 @@
 #define _POSIX_C_SOURCE 200809L
+#include "config.h"
+#if HAVE_MEMFD_CREATE
+#define _GNU_SOURCE
+#endif
 #include <assert.h>
 #include <cairo/cairo.h>
 #include <errno.h>
@@ -10,8 +14,10 @@
 #include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
+#include "log.h"
 #include "pool-buffer.h"
 
+#if !HAVE_MEMFD_CREATE
 static int anonymous_shm_open(void) {
 	int retries = 100;
 
@@ -36,6 +42,20 @@ static int anonymous_shm_open(void) {
 
 	return -1;
 }
+#endif
+
+static int open_shm_fd(void) {
+#if HAVE_MEMFD_CREATE
+	int fd = memfd_create("swaylock", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd >= 0) {
+		// Pools only ever grow; let the compositor rely on that
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+	}
+	return fd;
+#else
+	return anonymous_shm_open();
+#endif
+}
 
 static void buffer_release(void *data, struct wl_buffer *wl_buffer) {
 	struct pool_buffer *buffer = data;
@@ -46,6 +66,23 @@ static const struct wl_buffer_listener buffer_listener = {
 	.release = buffer_release
 };
 
+static void buffer_init_cairo(struct pool_buffer *buf) {
+	buf->surface = cairo_image_surface_create_for_data(buf->data,
+			CAIRO_FORMAT_ARGB32, buf->width, buf->height, buf->width * 4);
+	buf->cairo = cairo_create(buf->surface);
+}
+
+static void buffer_finish_cairo(struct pool_buffer *buf) {
+	if (buf->cairo) {
+		cairo_destroy(buf->cairo);
+	}
+	if (buf->surface) {
+		cairo_surface_destroy(buf->surface);
+	}
+	buf->cairo = NULL;
+	buf->surface = NULL;
+}
+
 struct pool_buffer *create_buffer(struct wl_shm *shm,
 		struct pool_buffer *buf, int32_t width, int32_t height,
 		uint32_t format) {
@@ -54,7 +91,7 @@ struct pool_buffer *create_buffer(struct wl_shm *shm,
 
 	void *data = NULL;
 	if (size > 0) {
-		int fd = anonymous_shm_open();
+		int fd = open_shm_fd();
 		if (fd == -1) {
 			return NULL;
 		}
@@ -63,11 +100,15 @@ struct pool_buffer *create_buffer(struct wl_shm *shm,
 			return NULL;
 		}
 		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-		struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-		buf->buffer = wl_shm_pool_create_buffer(pool, 0,
+		if (data == MAP_FAILED) {
+			close(fd);
+			return NULL;
+		}
+		// The pool is kept to allow changing the format later
+		buf->pool = wl_shm_create_pool(shm, fd, size);
+		buf->buffer = wl_shm_pool_create_buffer(buf->pool, 0,
 				width, height, stride, format);
 		wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
-		wl_shm_pool_destroy(pool);
 		close(fd);
 	}
 
@@ -75,53 +116,296 @@ struct pool_buffer *create_buffer(struct wl_shm *shm,
 	buf->width = width;
 	buf->height = height;
 	buf->data = data;
-	buf->surface = cairo_image_surface_create_for_data(data,
-			CAIRO_FORMAT_ARGB32, width, height, stride);
-	buf->cairo = cairo_create(buf->surface);
+	buf->format = format;
+	buffer_init_cairo(buf);
 	return buf;
 }
 
+void buffer_set_format(struct pool_buffer *buf, uint32_t format) {
+	if (!buf->pool || buf->format == format) {
+		return;
+	}
+	assert(!buf->busy);
+	wl_buffer_destroy(buf->buffer);
+	buf->buffer = wl_shm_pool_create_buffer(buf->pool, 0,
+			buf->width, buf->height, buf->width * 4, format);
+	wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
+	buf->format = format;
+}
+
+// Hands the whole pages of a freed range of the ring's pool back to the
+// system. The pool keeps its size, and the range reads as zeroes until it is
+// written again.
+static void buffer_ring_release_range(struct buffer_ring *ring,
+		size_t offset, size_t size) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = (offset + page - 1) / page * page;
+	size_t end = (offset + size) / page * page;
+	if (ring->fd == -1 || end <= start) {
+		return;
+	}
+	if (fallocate(ring->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			start, end - start) != 0 && errno != EOPNOTSUPP) {
+		swaylock_log_errno(LOG_DEBUG, "Failed to release shm pool pages");
+	}
+#endif
+}
+
 void destroy_buffer(struct pool_buffer *buffer) {
 	if (buffer->buffer) {
 		wl_buffer_destroy(buffer->buffer);
 	}
-	if (buffer->cairo) {
-		cairo_destroy(buffer->cairo);
+	if (buffer->pool) {
+		wl_shm_pool_destroy(buffer->pool);
 	}
-	if (buffer->surface) {
-		cairo_surface_destroy(buffer->surface);
-	}
-	if (buffer->data) {
+	buffer_finish_cairo(buffer);
+	if (buffer->data && !buffer->ring) {
 		munmap(buffer->data, buffer->size);
+	} else if (buffer->data) {
+		buffer_ring_release_range(buffer->ring, buffer->offset, buffer->size);
 	}
 	memset(buffer, 0, sizeof(struct pool_buffer));
 }
 
+// Buffers beyond min_buffers are freed after being unused for this long
+#define BUFFER_RING_IDLE_MS 5000
+
+void buffer_ring_init(struct buffer_ring *ring, size_t min_buffers,
+		size_t max_buffers) {
+	assert(min_buffers > 0 && min_buffers <= max_buffers);
+	memset(ring, 0, sizeof(struct buffer_ring));
+	wl_list_init(&ring->buffers);
+	ring->min_buffers = min_buffers;
+	ring->max_buffers = max_buffers;
+	ring->fd = -1;
+}
+
+static bool buffer_ring_grow(struct wl_shm *shm, struct buffer_ring *ring,
+		size_t capacity) {
+	if (ring->fd == -1) {
+		ring->fd = open_shm_fd();
+		if (ring->fd == -1) {
+			swaylock_log_errno(LOG_ERROR, "Failed to create shm pool");
+			return false;
+		}
+	}
+	if (ftruncate(ring->fd, capacity) < 0) {
+		swaylock_log_errno(LOG_ERROR, "Failed to resize shm pool");
+		return false;
+	}
+	void *data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+			ring->fd, 0);
+	if (data == MAP_FAILED) {
+		swaylock_log_errno(LOG_ERROR, "Failed to map shm pool");
+		return false;
+	}
+	if (ring->pool) {
+		wl_shm_pool_resize(ring->pool, capacity);
+	} else {
+		ring->pool = wl_shm_create_pool(shm, ring->fd, capacity);
+	}
+	if (ring->data) {
+		munmap(ring->data, ring->capacity);
+	}
+	ring->data = data;
+	ring->capacity = capacity;
+
+	// The mapping moved; point the existing buffers at it
+	struct pool_buffer *buffer;
+	wl_list_for_each(buffer, &ring->buffers, link) {
+		if (!buffer->buffer) {
+			continue;
+		}
+		buffer_finish_cairo(buffer);
+		buffer->data = (char *)ring->data + buffer->offset;
+		buffer_init_cairo(buffer);
+	}
+	return true;
+}
+
+static bool range_is_free(struct buffer_ring *ring, size_t offset,
+		size_t size) {
+	struct pool_buffer *buffer;
+	wl_list_for_each(buffer, &ring->buffers, link) {
+		if (buffer->buffer && offset < buffer->offset + buffer->size &&
+				buffer->offset < offset + size) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// First fit: the lowest offset right after another buffer (or at 0)
+static size_t buffer_ring_find_range(struct buffer_ring *ring, size_t size) {
+	size_t best = SIZE_MAX;
+	if (range_is_free(ring, 0, size)) {
+		best = 0;
+	}
+	struct pool_buffer *buffer;
+	wl_list_for_each(buffer, &ring->buffers, link) {
+		if (!buffer->buffer) {
+			continue;
+		}
+		size_t offset = buffer->offset + buffer->size;
+		if (offset < best && range_is_free(ring, offset, size)) {
+			best = offset;
+		}
+	}
+	return best;
+}
+
+static struct pool_buffer *buffer_ring_create_buffer(struct wl_shm *shm,
+		struct buffer_ring *ring, struct pool_buffer *buf,
+		uint32_t width, uint32_t height, uint32_t format) {
+	uint32_t stride = width * 4;
+	size_t size = (size_t)stride * height;
+	if (size == 0) {
+		return NULL;
+	}
+
+	size_t offset = buffer_ring_find_range(ring, size);
+	if (offset == SIZE_MAX || offset + size > ring->capacity) {
+		if (offset == SIZE_MAX) {
+			offset = ring->capacity;
+		}
+		size_t capacity = ring->capacity * 2;
+		if (capacity < size * ring->min_buffers) {
+			capacity = size * ring->min_buffers;
+		}
+		if (capacity < offset + size) {
+			capacity = offset + size;
+		}
+		if (!buffer_ring_grow(shm, ring, capacity)) {
+			return NULL;
+		}
+	}
+
+	buf->ring = ring;
+	buf->offset = offset;
+	buf->size = size;
+	buf->width = width;
+	buf->height = height;
+	buf->data = (char *)ring->data + offset;
+	if (offset < ring->high_water) {
+		// Recycled memory; callers expect new buffers to be cleared
+		memset(buf->data, 0, size);
+	}
+	if (offset + size > ring->high_water) {
+		ring->high_water = offset + size;
+	}
+	buf->format = format;
+	buf->buffer = wl_shm_pool_create_buffer(ring->pool, offset,
+			width, height, stride, format);
+	wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
+	buffer_init_cairo(buf);
+	return buf;
+}
+
+static void buffer_ring_remove(struct buffer_ring *ring,
+		struct pool_buffer *buffer) {
+	wl_list_remove(&buffer->link);
+	destroy_buffer(buffer);
+	free(buffer);
+	--ring->count;
+}
+
+static int64_t timespec_diff_ms(const struct timespec *a,
+		const struct timespec *b) {
+	return (a->tv_sec - b->tv_sec) * 1000 +
+		(a->tv_nsec - b->tv_nsec) / 1000000;
+}
+
+static void buffer_ring_shrink(struct buffer_ring *ring,
+		const struct timespec *now) {
+	// Walk from the least recently used end
+	struct pool_buffer *buffer, *tmp;
+	wl_list_for_each_reverse_safe(buffer, tmp, &ring->buffers, link) {
+		if (ring->count <= ring->min_buffers) {
+			break;
+		}
+		if (!buffer->busy &&
+				timespec_diff_ms(now, &buffer->last_used) > BUFFER_RING_IDLE_MS) {
+			buffer_ring_remove(ring, buffer);
+		}
+	}
+}
+
 struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-		struct pool_buffer pool[static 2], uint32_t width, uint32_t height) {
-	struct pool_buffer *buffer = NULL;
+		struct buffer_ring *ring, uint32_t width, uint32_t height) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	buffer_ring_shrink(ring, &now);
 
-	for (size_t i = 0; i < 2; ++i) {
-		if (pool[i].busy) {
+	// Prefer the most recently used buffer: it is the most likely to have
+	// the right size, and it lets the others go idle
+	struct pool_buffer *buffer = NULL, *iter;
+	wl_list_for_each(iter, &ring->buffers, link) {
+		if (iter->busy) {
 			continue;
 		}
-		buffer = &pool[i];
+		if (iter->width == width && iter->height == height) {
+			buffer = iter;
+			break;
+		}
+		if (!buffer) {
+			buffer = iter;
+		}
 	}
 
 	if (!buffer) {
-		return NULL;
+		++ring->starved;
+		if (ring->count >= ring->max_buffers) {
+			return NULL;
+		}
+		buffer = calloc(1, sizeof(struct pool_buffer));
+		if (!buffer) {
+			return NULL;
+		}
+		wl_list_insert(&ring->buffers, &buffer->link);
+		++ring->count;
+	} else {
+		wl_list_remove(&buffer->link);
+		wl_list_insert(&ring->buffers, &buffer->link);
 	}
 
 	if (buffer->width != width || buffer->height != height) {
+		struct wl_list link = buffer->link;
 		destroy_buffer(buffer);
+		buffer->link = link;
 	}
 
 	if (!buffer->buffer) {
-		if (!create_buffer(shm, buffer, width, height,
+		if (!buffer_ring_create_buffer(shm, ring, buffer, width, height,
 					WL_SHM_FORMAT_ARGB8888)) {
+			buffer_ring_remove(ring, buffer);
 			return NULL;
 		}
+		++ring->allocated;
+	} else {
+		++ring->reused;
 	}
 	buffer->busy = true;
+	buffer->last_used = now;
 	return buffer;
 }
+
+void buffer_ring_finish(struct buffer_ring *ring) {
+	struct pool_buffer *buffer, *tmp;
+	wl_list_for_each_safe(buffer, tmp, &ring->buffers, link) {
+		buffer_ring_remove(ring, buffer);
+	}
+	if (ring->pool) {
+		wl_shm_pool_destroy(ring->pool);
+	}
+	if (ring->data) {
+		munmap(ring->data, ring->capacity);
+	}
+	if (ring->fd != -1) {
+		close(ring->fd);
+	}
+	ring->pool = NULL;
+	ring->data = NULL;
+	ring->capacity = ring->high_water = 0;
+	ring->fd = -1;
+}
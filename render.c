@@ -1,106 +1,1146 @@
+#define _POSIX_C_SOURCE 200809L
 #include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <wayland-client.h>
 #include "cairo.h"
+#include "background-cache.h"
 #include "background-image.h"
 #include "swaylock.h"
 #include "log.h"
+#include "pixel-convert.h"
+#include "viewporter-client-protocol.h"
+#if HAVE_SINGLE_PIXEL_BUFFER
+#include "single-pixel-buffer-v1-client-protocol.h"
+#endif
 
 #define M_PI 3.14159265358979323846
 const float TYPE_INDICATOR_RANGE = M_PI / 3.0f;
 const float TYPE_INDICATOR_BORDER_THICKNESS = M_PI / 128.0f;
 
-static void set_color_for_state(cairo_t *cairo, struct swaylock_state *state,
+static uint32_t get_color_for_state(struct swaylock_state *state,
 		struct swaylock_colorset *colorset) {
 	if (state->input_state == INPUT_STATE_CLEAR) {
-		cairo_set_source_u32(cairo, colorset->cleared);
+		return colorset->cleared;
 	} else if (state->auth_state == AUTH_STATE_VALIDATING) {
-		cairo_set_source_u32(cairo, colorset->verifying);
+		return colorset->verifying;
 	} else if (state->auth_state == AUTH_STATE_INVALID) {
-		cairo_set_source_u32(cairo, colorset->wrong);
+		return colorset->wrong;
 	} else {
 		if (state->xkb.caps_lock && state->args.show_caps_lock_indicator) {
-			cairo_set_source_u32(cairo, colorset->caps_lock);
+			return colorset->caps_lock;
 		} else if (state->xkb.caps_lock && !state->args.show_caps_lock_indicator &&
-				state->args.show_caps_lock_text) {
-			uint32_t inputtextcolor = state->args.colors.text.input;
-			state->args.colors.text.input = state->args.colors.text.caps_lock;
-			cairo_set_source_u32(cairo, colorset->input);
-			state->args.colors.text.input = inputtextcolor;
+				state->args.show_caps_lock_text &&
+				colorset == &state->args.colors.text) {
+			// Only the text shows that Caps Lock is on
+			return colorset->caps_lock;
 		} else {
-			cairo_set_source_u32(cairo, colorset->input);
+			return colorset->input;
 		}
 	}
 }
 
-void render_frame_background(struct swaylock_surface *surface) {
+static void set_color_for_state(cairo_t *cairo, struct swaylock_state *state,
+		struct swaylock_colorset *colorset) {
+	cairo_set_source_u32(cairo, get_color_for_state(state, colorset));
+}
+
+double get_background_resolution(struct swaylock_state *state,
+		double width, double height) {
+	if (!state->viewporter) {
+		return 1; // nothing could upscale it
+	}
+	double factor = 1.0 / state->args.background_divisor;
+	uint64_t budget = state->args.background_pixel_budget;
+	if (budget > 0 && width * height * factor * factor > budget) {
+		factor = sqrt(budget / (width * height));
+	}
+	return factor;
+}
+
+static void log_shm_usage(struct swaylock_state *state) {
+	size_t backgrounds = 0, indicators = 0;
+	struct swaylock_background *background;
+	wl_list_for_each(background, &state->backgrounds, link) {
+		backgrounds += background->buffer.size;
+	}
+	struct swaylock_surface *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		indicators += surface->indicator_buffers.capacity;
+	}
+	swaylock_log(LOG_DEBUG, "Using %zu KiB of shm: %zu KiB for %d "
+			"background(s), %zu KiB for indicators",
+			(backgrounds + indicators) / 1024, backgrounds / 1024,
+			wl_list_length(&state->backgrounds), indicators / 1024);
+}
+
+// Unused backgrounds kept for later reuse while the outputs are being set up
+#define MAX_UNUSED_BACKGROUNDS 2
+
+static void finish_background_store(struct swaylock_background *background) {
+	if (background->storing) {
+		pthread_join(background->store_thread, NULL);
+		background->storing = false;
+		free(background->cache_key);
+		background->cache_key = NULL;
+	}
+}
+
+static void destroy_background(struct swaylock_background *background) {
+	// The writer still reads the buffer
+	finish_background_store(background);
+	wl_list_remove(&background->link);
+	destroy_buffer(&background->buffer);
+	free(background->cache_key);
+	free(background);
+}
+
+static void *store_background_thread(void *data) {
+	struct swaylock_background *background = data;
+	background_cache_store(background->cache_key, background->buffer.data,
+		background->width, background->height,
+		cairo_image_surface_get_stride(background->buffer.surface),
+		&background->opaque_box);
+	return NULL;
+}
+
+void store_backgrounds(struct swaylock_state *state) {
+	struct swaylock_background *background;
+	wl_list_for_each(background, &state->backgrounds, link) {
+		if (!background->cache_key || background->storing) {
+			continue;
+		}
+		// Nothing but the writer touches the key and pixels from now on
+		int err = pthread_create(&background->store_thread, NULL,
+			store_background_thread, background);
+		if (err != 0) {
+			swaylock_log(LOG_ERROR, "Failed to start writing %dx%d "
+					"background to the cache: %s", background->width,
+					background->height, strerror(err));
+			free(background->cache_key);
+			background->cache_key = NULL;
+			continue;
+		}
+		background->storing = true;
+	}
+}
+
+void finish_background_stores(struct swaylock_state *state) {
+	struct swaylock_background *background;
+	wl_list_for_each(background, &state->backgrounds, link) {
+		finish_background_store(background);
+	}
+}
+
+// Keeps the most recently used of the unused backgrounds
+static void drop_unused_backgrounds(struct swaylock_state *state, int keep) {
+	int unused = 0;
+	struct swaylock_background *iter, *tmp;
+	wl_list_for_each_safe(iter, tmp, &state->backgrounds, link) {
+		if (iter->refs == 0 && ++unused > keep) {
+			swaylock_log(LOG_DEBUG, "Dropping unused %dx%d background",
+					iter->width, iter->height);
+			destroy_background(iter);
+		}
+	}
+}
+
+void unref_background(struct swaylock_background *background) {
+	if (--background->refs > 0) {
+		return;
+	}
+	struct swaylock_state *state = background->state;
+	drop_unused_backgrounds(state,
+		state->locked ? 0 : MAX_UNUSED_BACKGROUNDS);
+}
+
+void release_unused_backgrounds(struct swaylock_state *state) {
+	drop_unused_backgrounds(state, 0);
+}
+
+// Best filter for the surface's backgrounds, see swaylock_background
+static enum image_filter get_filter_limit(struct swaylock_surface *surface) {
+	enum image_filter filter = surface->state->args.scaling_filter;
+	return filter == IMAGE_FILTER_AUTO ? surface->filter_limit : filter;
+}
+
+static void set_opaque_box(struct swaylock_background *background,
+		bool opaque) {
+	background->opaque = opaque;
+	background->opaque_box = (cairo_rectangle_int_t){0};
+	if (opaque) {
+		background->opaque_box.width = background->width;
+		background->opaque_box.height = background->height;
+	}
+}
+
+// The 90 and 270 degree transforms swap a buffer's width and height
+static bool is_transposed(enum wl_output_transform transform) {
+	return transform & 1;
+}
+
+// Maps a width x height buffer as displayed to the buffer rendered with the
+// transform, as wl_surface_set_buffer_transform() declares it
+static void get_transform_matrix(cairo_matrix_t *matrix,
+		enum wl_output_transform transform, int width, int height) {
+	switch (transform) {
+	case WL_OUTPUT_TRANSFORM_90:
+		cairo_matrix_init(matrix, 0, 1, -1, 0, height, 0);
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+		cairo_matrix_init(matrix, -1, 0, 0, -1, width, height);
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+		cairo_matrix_init(matrix, 0, -1, 1, 0, 0, width);
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		cairo_matrix_init(matrix, -1, 0, 0, 1, width, 0);
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		cairo_matrix_init(matrix, 0, -1, -1, 0, height, width);
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		cairo_matrix_init(matrix, 1, 0, 0, -1, 0, height);
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		cairo_matrix_init(matrix, 0, 1, 1, 0, 0, 0);
+		break;
+	default:
+		cairo_matrix_init_identity(matrix);
+		break;
+	}
+}
+
+static cairo_rectangle_int_t transform_rect(const cairo_matrix_t *matrix,
+		const cairo_rectangle_int_t *rect) {
+	double x0 = rect->x, y0 = rect->y;
+	double x1 = rect->x + rect->width, y1 = rect->y + rect->height;
+	cairo_matrix_transform_point(matrix, &x0, &y0);
+	cairo_matrix_transform_point(matrix, &x1, &y1);
+	return (cairo_rectangle_int_t){
+		fmin(x0, x1), fmin(y0, y1), fabs(x1 - x0), fabs(y1 - y0),
+	};
+}
+
+// Copies the image rotated and flipped like the contents of a buffer with
+// the transform
+static cairo_surface_t *transform_image(cairo_surface_t *image,
+		enum wl_output_transform transform) {
+	// The same operations as these EXIF orientations
+	static const int orientations[] = {
+		[WL_OUTPUT_TRANSFORM_90] = 6,
+		[WL_OUTPUT_TRANSFORM_180] = 3,
+		[WL_OUTPUT_TRANSFORM_270] = 8,
+		[WL_OUTPUT_TRANSFORM_FLIPPED] = 2,
+		[WL_OUTPUT_TRANSFORM_FLIPPED_90] = 7,
+		[WL_OUTPUT_TRANSFORM_FLIPPED_180] = 4,
+		[WL_OUTPUT_TRANSFORM_FLIPPED_270] = 5,
+	};
+	int w = cairo_image_surface_get_width(image);
+	int h = cairo_image_surface_get_height(image);
+	bool transposed = is_transposed(transform);
+	cairo_surface_t *out = cairo_image_surface_create(
+		cairo_image_surface_get_format(image),
+		transposed ? h : w, transposed ? w : h);
+	if (cairo_surface_status(out) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(out);
+		return NULL;
+	}
+
+	cairo_surface_flush(image);
+	const uint8_t *src = cairo_image_surface_get_data(image);
+	int src_stride = cairo_image_surface_get_stride(image);
+	uint32_t *dst = (uint32_t *)cairo_image_surface_get_data(out);
+	int dst_stride = cairo_image_surface_get_stride(out) / 4;
+	// Bands of rows are rotated together where they are contiguous
+	int band = src_stride == w * 4 ? PIXEL_ORIENT_BAND_ROWS : 1;
+	for (int y = 0; y < h; y += band) {
+		int n = h - y < band ? h - y : band;
+		pixel_store_oriented_rows(dst, dst_stride,
+			(const uint32_t *)(src + (size_t)y * src_stride), w, h, y, n,
+			orientations[transform]);
+	}
+	cairo_surface_mark_dirty(out);
+	return out;
+}
+
+static struct swaylock_background *create_background(
+		struct swaylock_surface *surface, struct swaylock_image *image,
+		int buffer_width, int buffer_height,
+		enum wl_output_transform transform, bool wait) {
 	struct swaylock_state *state = surface->state;
+	struct swaylock_background *background =
+		calloc(1, sizeof(struct swaylock_background));
+	if (!background) {
+		return NULL;
+	}
+	struct pool_buffer *buffer = &background->buffer;
+	bool single_pixel = !image && buffer_width == 1 && buffer_height == 1 &&
+		state->single_pixel_buffer_manager;
+	if (!single_pixel && !create_buffer(state->shm, buffer, buffer_width,
+			buffer_height, WL_SHM_FORMAT_ARGB8888)) {
+		free(background);
+		return NULL;
+	}
 
-	int buffer_width = surface->width * surface->scale;
-	int buffer_height = surface->height * surface->scale;
-	if (buffer_width == 0 || buffer_height == 0) {
-		return; // not yet configured
+	background->state = state;
+	background->image = image;
+	background->mode = state->args.mode;
+	background->color = state->args.colors.background;
+	background->filter = state->args.scaling_filter;
+	background->filter_limit = get_filter_limit(surface);
+	background->transform = transform;
+	background->width = buffer_width;
+	background->height = buffer_height;
+	wl_list_insert(&state->backgrounds, &background->link);
+
+#if HAVE_SINGLE_PIXEL_BUFFER
+	if (single_pixel) {
+		uint32_t color = state->args.colors.background;
+		// Channels are premultiplied and scaled up to 32 bits
+		uint64_t a = color & 0xff;
+		uint32_t rgba[4];
+		for (int i = 0; i < 4; ++i) {
+			uint64_t c = i < 3 ? (color >> (24 - 8 * i) & 0xff) * a : a * 0xff;
+			rgba[i] = c * UINT32_MAX / (0xff * 0xff);
+		}
+		buffer->buffer = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+			state->single_pixel_buffer_manager,
+			rgba[0], rgba[1], rgba[2], rgba[3]);
+		set_opaque_box(background, a == 0xff);
+		return background;
 	}
+#endif
 
-	wl_surface_set_buffer_scale(surface->surface, surface->scale);
+	char *cache_key = NULL;
+	if (image) {
+		cache_key = background_cache_key(image->path, buffer_width,
+			buffer_height, transform, state->args.mode,
+			state->args.colors.background, background->filter,
+			background->filter_limit);
+	}
+	int stride = cairo_image_surface_get_stride(buffer->surface);
+	if (cache_key && background_cache_load(cache_key, buffer->data,
+			buffer_width, buffer_height, stride, &background->opaque_box)) {
+		background->opaque = background->opaque_box.width == buffer_width &&
+			background->opaque_box.height == buffer_height;
+		swaylock_log(LOG_DEBUG, "Loaded %dx%d background for %s from cache",
+				buffer_width, buffer_height, image->path);
+		cairo_surface_mark_dirty(buffer->surface);
+		free(cache_key);
+		return background;
+	}
 
-	if (buffer_width != surface->last_buffer_width ||
-			buffer_height != surface->last_buffer_height) {
-		struct pool_buffer buffer;
-		if (!create_buffer(state->shm, &buffer, buffer_width, buffer_height,
-				WL_SHM_FORMAT_ARGB8888)) {
-			swaylock_log(LOG_ERROR,
-				"Failed to create new buffer for frame background.");
-			return;
+	cairo_surface_t *image_surface = NULL;
+	if (image && image->decoding && !wait) {
+		// Stand in with the plain background color for now
+		background->image = NULL;
+	} else if (image) {
+		image_surface = load_image_surface(image, buffer_width,
+			buffer_height);
+	}
+	// Tiles start at the top left corner of the output as displayed
+	int tile_x = 0, tile_y = 0;
+	cairo_surface_t *transformed = NULL;
+	if (image_surface && transform != WL_OUTPUT_TRANSFORM_NORMAL) {
+		bool transposed = is_transposed(transform);
+		cairo_matrix_t matrix;
+		get_transform_matrix(&matrix, transform,
+			transposed ? buffer_height : buffer_width,
+			transposed ? buffer_width : buffer_height);
+		cairo_rectangle_int_t tile = transform_rect(&matrix,
+			&(cairo_rectangle_int_t){0, 0,
+				cairo_image_surface_get_width(image_surface),
+				cairo_image_surface_get_height(image_surface)});
+		tile_x = tile.x;
+		tile_y = tile.y;
+		// Rendered like any other image onto the buffer's own orientation
+		transformed = transform_image(image_surface, transform);
+		if (!transformed) {
+			swaylock_log(LOG_ERROR, "Failed to transform image %s",
+					image->path);
 		}
+		image_surface = transformed;
+	}
+	if (image_surface) {
+		// Written out once the buffer has been handed to the compositor
+		background->cache_key = cache_key;
+	} else {
+		free(cache_key);
+	}
+	// The color is painted everywhere, an opaque image only covers its
+	// own rectangle in some modes
+	if ((state->args.colors.background & 0xff) == 0xff) {
+		set_opaque_box(background, true);
+	} else if (image_surface &&
+			cairo_surface_get_content(image_surface) == CAIRO_CONTENT_COLOR) {
+		background->opaque_box = background_image_coverage(state->args.mode,
+			cairo_image_surface_get_width(image_surface),
+			cairo_image_surface_get_height(image_surface),
+			buffer_width, buffer_height);
+		background->opaque = background->opaque_box.width == buffer_width &&
+			background->opaque_box.height == buffer_height;
+	} else {
+		set_opaque_box(background, false);
+	}
+
+	enum image_filter filter = IMAGE_FILTER_NEAREST;
+	if (image_surface) {
+		filter = background_image_filter(background->filter,
+			background->filter_limit, state->args.mode,
+			cairo_image_surface_get_width(image_surface),
+			cairo_image_surface_get_height(image_surface),
+			buffer_width, buffer_height);
+	}
 
-		cairo_t *cairo = buffer.cairo;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// Scaled and tiled images are written straight into the buffer, which
+	// also saves filling it with the background color first
+	const char *method = "scaler";
+	if (image_surface && render_background_image_direct(buffer->data,
+			stride, buffer_width, buffer_height, image_surface,
+			state->args.mode, state->args.colors.background, filter,
+			tile_x, tile_y)) {
+		cairo_surface_mark_dirty(buffer->surface);
+	} else {
+		method = "cairo";
+		cairo_t *cairo = buffer->cairo;
 		cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
 
 		cairo_save(cairo);
 		cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
 		cairo_set_source_u32(cairo, state->args.colors.background);
 		cairo_paint(cairo);
-		if (surface->image && state->args.mode != BACKGROUND_MODE_SOLID_COLOR) {
+		if (image_surface) {
 			cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
-			render_background_image(cairo, surface->image,
-				state->args.mode, buffer_width, buffer_height);
+			render_background_image(cairo, image_surface,
+				state->args.mode, buffer_width, buffer_height, filter,
+				tile_x, tile_y);
 		}
 		cairo_restore(cairo);
 		cairo_identity_matrix(cairo);
+		cairo_surface_flush(buffer->surface);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (transformed) {
+		cairo_surface_destroy(transformed);
+	}
+	if (!image_surface) {
+		return background;
+	}
 
-		wl_surface_attach(surface->surface, buffer.buffer, 0, 0);
-		wl_surface_damage_buffer(surface->surface, 0, 0, INT32_MAX, INT32_MAX);
-		wl_surface_commit(surface->surface);
-		destroy_buffer(&buffer);
+	static const char *filter_names[] = {
+		[IMAGE_FILTER_NEAREST] = "nearest",
+		[IMAGE_FILTER_BILINEAR] = "bilinear",
+		[IMAGE_FILTER_GOOD] = "good",
+		[IMAGE_FILTER_BEST] = "best",
+	};
+	double elapsed = (end.tv_sec - start.tv_sec) * 1e3 +
+		(end.tv_nsec - start.tv_nsec) / 1e6;
+	swaylock_log(LOG_DEBUG, "Rendered %dx%d background with %s (%s filter) "
+			"in %.1f ms", buffer_width, buffer_height, method,
+			filter_names[filter], elapsed);
+
+	// With --scaling-filter=auto, settle for a cheaper filter next time
+	// this output needs a background if this one took more than a frame
+	double budget = surface->mode_refresh > 0 ?
+		1e6 / surface->mode_refresh : 1e3 / 60;
+	if (background->filter == IMAGE_FILTER_AUTO && elapsed > budget &&
+			filter > IMAGE_FILTER_NEAREST && filter <= surface->filter_limit) {
+		surface->filter_limit = filter - 1;
+		swaylock_log(LOG_DEBUG, "Rendering exceeded the %.1f ms frame budget, "
+				"limiting %s to the %s filter", budget,
+				surface->output_name ? surface->output_name : "output",
+				filter_names[surface->filter_limit]);
+	}
+	return background;
+}
+
+static struct swaylock_background *get_background(
+		struct swaylock_surface *surface, struct swaylock_image *image,
+		int buffer_width, int buffer_height,
+		enum wl_output_transform transform, bool wait) {
+	struct swaylock_state *state = surface->state;
+	enum image_filter filter_limit = get_filter_limit(surface);
+	struct swaylock_background *background;
+	wl_list_for_each(background, &state->backgrounds, link) {
+		if (background->image == image &&
+				background->mode == state->args.mode &&
+				background->color == state->args.colors.background &&
+				background->filter == state->args.scaling_filter &&
+				background->filter_limit == filter_limit &&
+				background->transform == transform &&
+				background->width == buffer_width &&
+				background->height == buffer_height) {
+			++background->refs;
+			wl_list_remove(&background->link);
+			wl_list_insert(&state->backgrounds, &background->link);
+			return background;
+		}
+	}
+
+	background = create_background(surface, image, buffer_width,
+		buffer_height, transform, wait);
+	if (!background) {
+		return NULL;
+	}
+	background->refs = 1;
+	log_shm_usage(state);
+	// Lets the compositor skip blending the whole surface. The indicator
+	// is drawn on the subsurface and keeps ARGB8888.
+	if (background->opaque && state->shm_xrgb8888) {
+		buffer_set_format(&background->buffer, WL_SHM_FORMAT_XRGB8888);
+	}
+	return background;
+}
+
+// Device pixels per surface coordinate
+static double get_render_scale(struct swaylock_surface *surface) {
+	if (surface->fractional_scale) {
+		return surface->fractional_scale / 120.0;
+	}
+	return surface->scale;
+}
+
+bool get_background_size(struct swaylock_surface *surface,
+		int *width, int *height, bool *viewported) {
+	struct swaylock_state *state = surface->state;
+	// Before create_surface(), assume the surface gets what is offered
+	bool has_viewport = surface->created ?
+		surface->viewport != NULL : state->viewporter != NULL;
+	bool has_fractional_scale = surface->created ?
+		surface->wp_fractional_scale != NULL :
+		has_viewport && state->fractional_scale_manager;
+	bool transposed = is_transposed(surface->transform);
 
-		surface->last_buffer_width = buffer_width;
-		surface->last_buffer_height = buffer_height;
+	// Device pixels as displayed. A fractional scale buffer matches the
+	// output's mode, so that is the size until the compositor has
+	// suggested a scale, and before the surface is configured.
+	double w, h;
+	if (surface->width > 0 && surface->height > 0 &&
+			(surface->fractional_scale || !has_fractional_scale)) {
+		double scale = get_render_scale(surface);
+		w = surface->width * scale;
+		h = surface->height * scale;
+	} else if (surface->mode_width > 0 && surface->mode_height > 0) {
+		w = transposed ? surface->mode_height : surface->mode_width;
+		h = transposed ? surface->mode_width : surface->mode_height;
+	} else if (surface->width > 0 && surface->height > 0) {
+		w = surface->width * surface->scale;
+		h = surface->height * surface->scale;
 	} else {
+		return false;
+	}
+
+	*viewported = false;
+	if (has_viewport) {
+		double factor = get_background_resolution(state, w, h);
+		if (has_fractional_scale || factor < 1) {
+			w = fmax(round(w * factor), 1);
+			h = fmax(round(h * factor), 1);
+			*viewported = true;
+		}
+	}
+	*width = transposed ? h : w;
+	*height = transposed ? w : h;
+	return true;
+}
+
+bool background_is_cached(struct swaylock_surface *surface,
+		struct swaylock_image *image) {
+	struct swaylock_state *state = surface->state;
+	int width, height;
+	bool viewported;
+	if (!get_background_size(surface, &width, &height, &viewported)) {
+		return false;
+	}
+	char *key = background_cache_key(image->path, width, height,
+		surface->transform, state->args.mode, state->args.colors.background,
+		state->args.scaling_filter, get_filter_limit(surface));
+	bool cached = key && background_cache_contains(key, width, height,
+		width * 4);
+	free(key);
+	return cached;
+}
+
+// Sets the destination unless already set, 0x0 unsets it
+static void set_viewport_destination(struct wp_viewport *viewport,
+		uint32_t *current_width, uint32_t *current_height,
+		uint32_t width, uint32_t height) {
+	if (!viewport || (*current_width == width && *current_height == height)) {
+		return;
+	}
+	wp_viewport_set_destination(viewport,
+		width ? (int32_t)width : -1, height ? (int32_t)height : -1);
+	*current_width = width;
+	*current_height = height;
+}
+
+static void set_background_opaque_region(struct swaylock_surface *surface,
+		struct swaylock_background *background) {
+	struct wl_region *region = NULL;
+	const cairo_rectangle_int_t *box = &background->opaque_box;
+	if (background->opaque) {
+		region = wl_compositor_create_region(surface->state->compositor);
+		wl_region_add(region, 0, 0, INT32_MAX, INT32_MAX);
+	} else if (box->width > 0 && box->height > 0) {
+		// Back to the orientation as displayed, then to surface
+		// coordinates, rounding inwards
+		bool transposed = is_transposed(background->transform);
+		int width = transposed ? background->height : background->width;
+		int height = transposed ? background->width : background->height;
+		cairo_matrix_t matrix;
+		get_transform_matrix(&matrix, background->transform, width, height);
+		cairo_matrix_invert(&matrix);
+		cairo_rectangle_int_t displayed = transform_rect(&matrix, box);
+		box = &displayed;
+		double sx = (double)surface->width / width;
+		double sy = (double)surface->height / height;
+		int x0 = ceil(box->x * sx), y0 = ceil(box->y * sy);
+		int x1 = floor((box->x + box->width) * sx);
+		int y1 = floor((box->y + box->height) * sy);
+		if (x1 > x0 && y1 > y0) {
+			region = wl_compositor_create_region(surface->state->compositor);
+			wl_region_add(region, x0, y0, x1 - x0, y1 - y0);
+		}
+	}
+	wl_surface_set_opaque_region(surface->surface, region);
+	if (region) {
+		wl_region_destroy(region);
+	}
+}
+
+void render_frame_background(struct swaylock_surface *surface) {
+	struct swaylock_state *state = surface->state;
+
+	if (surface->width == 0 || surface->height == 0) {
+		return; // not yet configured
+	}
+
+	struct swaylock_image *image = NULL;
+	if (state->args.mode != BACKGROUND_MODE_SOLID_COLOR) {
+		image = surface->image;
+	}
+
+	// The viewport stretches a plain color's single pixel over the whole
+	// surface, or maps a buffer at the exact fractional scale or at the
+	// reduced --background-resolution onto it
+	int buffer_width, buffer_height;
+	bool viewported;
+	if (!image && surface->viewport) {
+		buffer_width = buffer_height = 1;
+		viewported = true;
+	} else {
+		get_background_size(surface, &buffer_width, &buffer_height,
+			&viewported);
+	}
+	enum wl_output_transform transform = surface->transform;
+	wl_surface_set_buffer_transform(surface->surface, transform);
+	if (viewported) {
+		wl_surface_set_buffer_scale(surface->surface, 1);
+		set_viewport_destination(surface->viewport, &surface->viewport_width,
+			&surface->viewport_height, surface->width, surface->height);
+	} else {
+		wl_surface_set_buffer_scale(surface->surface, surface->scale);
+		set_viewport_destination(surface->viewport, &surface->viewport_width,
+			&surface->viewport_height, 0, 0);
+	}
+
+	// With --progressive-image, the background color is shown until the
+	// image has been decoded; image_ready_in() then renders it again
+	bool pending = image && image->decoding && state->args.progressive_image;
+
+	struct swaylock_background *current = surface->background;
+	if (current && (current->image == image || (pending && !current->image)) &&
+			current->transform == transform &&
+			current->width == buffer_width &&
+			current->height == buffer_height) {
 		wl_surface_commit(surface->surface);
+		return;
+	}
+
+	struct swaylock_background *background = get_background(surface, image,
+		buffer_width, buffer_height, transform, !pending);
+	if (!background) {
+		swaylock_log(LOG_ERROR,
+			"Failed to create new buffer for frame background.");
+		return;
+	}
+	if (background->refs > 1) {
+		swaylock_log(LOG_DEBUG, "Sharing %dx%d background buffer with %d "
+				"other output(s)", buffer_width, buffer_height,
+				background->refs - 1);
+	}
+
+	set_background_opaque_region(surface, background);
+
+	wl_surface_attach(surface->surface, background->buffer.buffer, 0, 0);
+	wl_surface_damage_buffer(surface->surface, 0, 0,
+			buffer_width, buffer_height);
+	wl_surface_commit(surface->surface);
+
+	if (current) {
+		unref_background(current);
+	}
+	surface->background = background;
+
+	if (state->run_display) {
+		// Until then, main() starts the writers once the session is locked
+		store_backgrounds(state);
+	}
+}
+
+// Horizontal bands approximating each half of the inner circle
+#define INDICATOR_OPAQUE_BANDS 6
+
+static void set_indicator_opaque_region(struct swaylock_surface *surface,
+		bool visible, int buffer_width, int buffer_diameter) {
+	struct swaylock_state *state = surface->state;
+	double scale = get_render_scale(surface);
+	uint32_t inside = get_color_for_state(state, &state->args.colors.inside);
+	struct wl_region *region = NULL;
+	// The inner circle, less its antialiased edge, in surface coordinates
+	double r = ((state->args.radius * scale -
+		state->args.thickness * scale / 2) - 1.0) / scale;
+	if (visible && (inside & 0xff) == 0xff && r > 1) {
+		double cx = (double)(buffer_width / 2) / scale;
+		double cy = (double)(buffer_diameter / 2) / scale;
+		region = wl_compositor_create_region(state->compositor);
+		for (int i = 0; i < INDICATOR_OPAQUE_BANDS; ++i) {
+			double near = r * i / INDICATOR_OPAQUE_BANDS;
+			double far = r * (i + 1) / INDICATOR_OPAQUE_BANDS;
+			double half_width = sqrt(r * r - far * far);
+			int x0 = ceil(cx - half_width), x1 = floor(cx + half_width);
+			int top0 = ceil(cy - far), top1 = floor(cy - near);
+			int bottom0 = ceil(cy + near), bottom1 = floor(cy + far);
+			if (x1 <= x0) {
+				continue;
+			}
+			if (top1 > top0) {
+				wl_region_add(region, x0, top0, x1 - x0, top1 - top0);
+			}
+			if (bottom1 > bottom0) {
+				wl_region_add(region, x0, bottom0, x1 - x0, bottom1 - bottom0);
+			}
+		}
+	}
+	wl_surface_set_opaque_region(surface->child, region);
+	if (region) {
+		wl_region_destroy(region);
+	}
+}
+
+#define MAX_TEXT_RUNS 16
+
+void destroy_font_cache(struct swaylock_font_cache *cache) {
+	if (!cache->scaled_font) {
+		return;
+	}
+	struct swaylock_text_run *run, *tmp;
+	wl_list_for_each_safe(run, tmp, &cache->runs, link) {
+		wl_list_remove(&run->link);
+		cairo_glyph_free(run->glyphs);
+		free(run->text);
+		free(run);
 	}
+	cairo_scaled_font_destroy(cache->scaled_font);
+	memset(cache, 0, sizeof(struct swaylock_font_cache));
 }
 
-static void configure_font_drawing(cairo_t *cairo, struct swaylock_state *state,
-		enum wl_output_subpixel subpixel, int arc_radius) {
+static struct swaylock_font_cache *get_font_cache(
+		struct swaylock_surface *surface, int arc_radius) {
+	struct swaylock_state *state = surface->state;
+	double scale = get_render_scale(surface);
+	struct swaylock_font_cache *cache = &surface->font_cache;
+	double size;
+	if (state->args.font_size > 0) {
+		size = state->args.font_size;
+	} else {
+		size = arc_radius / 3.0f;
+	}
+	if (cache->scaled_font && cache->size == size &&
+			cache->scale == scale &&
+			cache->subpixel == surface->subpixel) {
+		return cache;
+	}
+	destroy_font_cache(cache);
+
 	cairo_font_options_t *fo = cairo_font_options_create();
 	cairo_font_options_set_hint_style(fo, CAIRO_HINT_STYLE_FULL);
 	cairo_font_options_set_antialias(fo, CAIRO_ANTIALIAS_SUBPIXEL);
-	cairo_font_options_set_subpixel_order(fo, to_cairo_subpixel_order(subpixel));
-
-	cairo_set_font_options(cairo, fo);
-	cairo_select_font_face(cairo, state->args.font,
+	cairo_font_options_set_subpixel_order(fo,
+			to_cairo_subpixel_order(surface->subpixel));
+	cairo_font_face_t *face = cairo_toy_font_face_create(state->args.font,
 		CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-	if (state->args.font_size > 0) {
-		cairo_set_font_size(cairo, state->args.font_size);
+	cairo_matrix_t font_matrix, ctm;
+	cairo_matrix_init_scale(&font_matrix, size, size);
+	cairo_matrix_init_identity(&ctm);
+	cairo_scaled_font_t *scaled_font =
+		cairo_scaled_font_create(face, &font_matrix, &ctm, fo);
+	cairo_font_face_destroy(face);
+	cairo_font_options_destroy(fo);
+	if (cairo_scaled_font_status(scaled_font) != CAIRO_STATUS_SUCCESS) {
+		swaylock_log(LOG_ERROR, "Failed to set up font %s", state->args.font);
+		cairo_scaled_font_destroy(scaled_font);
+		return NULL;
+	}
+
+	cache->scaled_font = scaled_font;
+	cairo_scaled_font_extents(scaled_font, &cache->extents);
+	cache->size = size;
+	cache->scale = scale;
+	cache->subpixel = surface->subpixel;
+	wl_list_init(&cache->runs);
+	cache->num_runs = 0;
+	return cache;
+}
+
+static struct swaylock_text_run *get_text_run(struct swaylock_font_cache *cache,
+		const char *text) {
+	struct swaylock_text_run *run;
+	wl_list_for_each(run, &cache->runs, link) {
+		if (strcmp(run->text, text) == 0) {
+			wl_list_remove(&run->link);
+			wl_list_insert(&cache->runs, &run->link);
+			return run;
+		}
+	}
+
+	if (cache->num_runs >= MAX_TEXT_RUNS) {
+		// Evict the least recently used run
+		run = wl_container_of(cache->runs.prev, run, link);
+		wl_list_remove(&run->link);
+		cairo_glyph_free(run->glyphs);
+		free(run->text);
+		free(run);
+		--cache->num_runs;
+	}
+
+	run = calloc(1, sizeof(struct swaylock_text_run));
+	if (!run) {
+		return NULL;
+	}
+	if (cairo_scaled_font_text_to_glyphs(cache->scaled_font, 0, 0, text, -1,
+			&run->glyphs, &run->num_glyphs, NULL, NULL, NULL)
+			!= CAIRO_STATUS_SUCCESS) {
+		swaylock_log(LOG_ERROR, "Failed to convert '%s' to glyphs", text);
+		free(run);
+		return NULL;
+	}
+	cairo_scaled_font_glyph_extents(cache->scaled_font, run->glyphs,
+			run->num_glyphs, &run->extents);
+	run->text = strdup(text);
+	wl_list_insert(&cache->runs, &run->link);
+	++cache->num_runs;
+	return run;
+}
+
+static void show_text_run(cairo_t *cairo, struct swaylock_font_cache *cache,
+		struct swaylock_text_run *run, double x, double y) {
+	cairo_save(cairo);
+	cairo_translate(cairo, x, y);
+	cairo_set_scaled_font(cairo, cache->scaled_font);
+	cairo_show_glyphs(cairo, run->glyphs, run->num_glyphs);
+	cairo_restore(cairo);
+}
+
+static void rectangle_from_extents(cairo_rectangle_int_t *rect,
+		double x1, double y1, double x2, double y2, double padding) {
+	rect->x = floor(x1 - padding);
+	rect->y = floor(y1 - padding);
+	rect->width = ceil(x2 + padding) - rect->x;
+	rect->height = ceil(y2 + padding) - rect->y;
+}
+
+static void render_indicator_base(cairo_t *cairo,
+		struct swaylock_surface *surface, const char *text,
+		const char *layout_text, int buffer_width, int buffer_diameter,
+		struct swaylock_indicator_cache *cache) {
+	struct swaylock_state *state = surface->state;
+	double scale = get_render_scale(surface);
+	int arc_radius = state->args.radius * scale;
+	int arc_thickness = state->args.thickness * scale;
+
+	// Fill inner circle
+	cairo_set_line_width(cairo, 0);
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
+			arc_radius - arc_thickness / 2, 0, 2 * M_PI);
+	set_color_for_state(cairo, state, &state->args.colors.inside);
+	cairo_fill_preserve(cairo);
+	cairo_stroke(cairo);
+
+	// Draw ring
+	cairo_set_line_width(cairo, arc_thickness);
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2, arc_radius,
+			0, 2 * M_PI);
+	set_color_for_state(cairo, state, &state->args.colors.ring);
+	cairo_stroke(cairo);
+
+	// Draw a message
+	struct swaylock_font_cache *font = get_font_cache(surface, arc_radius);
+	set_color_for_state(cairo, state, &state->args.colors.text);
+
+	struct swaylock_text_run *run;
+	if (text && font && (run = get_text_run(font, text))) {
+		cairo_text_extents_t extents = run->extents;
+		cairo_font_extents_t fe = font->extents;
+		double x, y;
+		x = (buffer_width / 2) -
+			(extents.width / 2 + extents.x_bearing);
+		y = (buffer_diameter / 2) +
+			(fe.height / 2 - fe.descent);
+
+		show_text_run(cairo, font, run, x, y);
+
+		rectangle_from_extents(&cache->text_box,
+			x + extents.x_bearing, y + extents.y_bearing,
+			x + extents.x_bearing + extents.width,
+			y + extents.y_bearing + extents.height, 2.0 * scale);
+	}
+
+	// display layout text separately
+	if (layout_text && font && (run = get_text_run(font, layout_text))) {
+		cairo_text_extents_t extents = run->extents;
+		cairo_font_extents_t fe = font->extents;
+		double x, y;
+		double box_padding = 4.0 * scale;
+		cairo_set_line_width(cairo, 2.0 * scale);
+		// upper left coordinates for box
+		x = (buffer_width / 2) - (extents.width / 2) - box_padding;
+		y = buffer_diameter;
+
+		// background box
+		cairo_rectangle(cairo, x, y,
+			extents.width + 2.0 * box_padding,
+			fe.height + 2.0 * box_padding);
+		cairo_set_source_u32(cairo, state->args.colors.layout_background);
+		cairo_fill_preserve(cairo);
+		// border
+		cairo_set_source_u32(cairo, state->args.colors.layout_border);
+		cairo_stroke(cairo);
+
+		// take font extents and padding into account
+		cairo_set_source_u32(cairo, state->args.colors.layout_text);
+		show_text_run(cairo, font, run,
+			x - extents.x_bearing + box_padding,
+			y + (fe.height - fe.descent) + box_padding);
+
+		rectangle_from_extents(&cache->layout_box, x, y,
+			x + extents.width + 2.0 * box_padding,
+			y + fe.height + 2.0 * box_padding, 2.0 * scale);
+	}
+}
+
+static void render_indicator_overlay(cairo_t *cairo,
+		struct swaylock_surface *surface, int buffer_width,
+		int buffer_diameter) {
+	struct swaylock_state *state = surface->state;
+	double scale = get_render_scale(surface);
+	int arc_radius = state->args.radius * scale;
+	int arc_thickness = state->args.thickness * scale;
+
+	// Draw inner + outer border of the circle
+	set_color_for_state(cairo, state, &state->args.colors.line);
+	cairo_set_line_width(cairo, 2.0 * scale);
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
+			arc_radius - arc_thickness / 2, 0, 2 * M_PI);
+	cairo_stroke(cairo);
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
+			arc_radius + arc_thickness / 2, 0, 2 * M_PI);
+	cairo_stroke(cairo);
+}
+
+static void render_indicator_highlight(cairo_t *cairo,
+		struct swaylock_surface *surface, int buffer_width,
+		int buffer_diameter) {
+	struct swaylock_state *state = surface->state;
+	double scale = get_render_scale(surface);
+	int arc_radius = state->args.radius * scale;
+	int arc_thickness = state->args.thickness * scale;
+	float type_indicator_border_thickness =
+		TYPE_INDICATOR_BORDER_THICKNESS * scale;
+
+	// Typing indicator: Highlight random part on keypress
+	double highlight_start = state->highlight_start * (M_PI / 1024.0);
+	cairo_set_line_width(cairo, arc_thickness);
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
+			arc_radius, highlight_start,
+			highlight_start + TYPE_INDICATOR_RANGE);
+	if (state->input_state == INPUT_STATE_LETTER) {
+		if (state->xkb.caps_lock && state->args.show_caps_lock_indicator) {
+			cairo_set_source_u32(cairo, state->args.colors.caps_lock_key_highlight);
+		} else {
+			cairo_set_source_u32(cairo, state->args.colors.key_highlight);
+		}
 	} else {
-		cairo_set_font_size(cairo, arc_radius / 3.0f);
+		if (state->xkb.caps_lock && state->args.show_caps_lock_indicator) {
+			cairo_set_source_u32(cairo, state->args.colors.caps_lock_bs_highlight);
+		} else {
+			cairo_set_source_u32(cairo, state->args.colors.bs_highlight);
+		}
 	}
-	cairo_font_options_destroy(fo);
+	cairo_stroke(cairo);
+
+	// Draw borders
+	cairo_set_source_u32(cairo, state->args.colors.separator);
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
+			arc_radius, highlight_start,
+			highlight_start + type_indicator_border_thickness);
+	cairo_stroke(cairo);
+
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
+			arc_radius, highlight_start + TYPE_INDICATOR_RANGE,
+			highlight_start + TYPE_INDICATOR_RANGE +
+				type_indicator_border_thickness);
+	cairo_stroke(cairo);
+}
+
+// Bounds of everything render_indicator_highlight() touches
+static void indicator_highlight_box(cairo_t *cairo,
+		struct swaylock_surface *surface, int buffer_width,
+		int buffer_diameter, cairo_rectangle_int_t *box) {
+	struct swaylock_state *state = surface->state;
+	double scale = get_render_scale(surface);
+	int arc_radius = state->args.radius * scale;
+	int arc_thickness = state->args.thickness * scale;
+	float type_indicator_border_thickness =
+		TYPE_INDICATOR_BORDER_THICKNESS * scale;
+
+	double highlight_start = state->highlight_start * (M_PI / 1024.0);
+	double x1, y1, x2, y2;
+	cairo_save(cairo);
+	cairo_new_path(cairo);
+	cairo_set_line_width(cairo, arc_thickness);
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
+			arc_radius, highlight_start,
+			highlight_start + TYPE_INDICATOR_RANGE +
+				type_indicator_border_thickness);
+	cairo_stroke_extents(cairo, &x1, &y1, &x2, &y2);
+	cairo_new_path(cairo);
+	cairo_restore(cairo);
+	rectangle_from_extents(box, x1, y1, x2, y2, 1.0);
+}
+
+static bool indicator_cache_matches(struct swaylock_indicator_cache *cache,
+		struct swaylock_surface *surface, const char *text,
+		const char *layout_text, int width, int height) {
+	struct swaylock_state *state = surface->state;
+	double scale = get_render_scale(surface);
+	return cache->base &&
+		cache->auth_state == state->auth_state &&
+		cache->cleared == (state->input_state == INPUT_STATE_CLEAR) &&
+		cache->caps_lock == state->xkb.caps_lock &&
+		lenient_strcmp(cache->text, text) == 0 &&
+		lenient_strcmp(cache->layout_text, layout_text) == 0 &&
+		cache->scale == scale &&
+		cache->subpixel == surface->subpixel &&
+		cache->width == width && cache->height == height;
+}
+
+void destroy_indicator_cache(struct swaylock_indicator_cache *cache) {
+	if (cache->base) {
+		cairo_surface_destroy(cache->base);
+	}
+	if (cache->overlay) {
+		cairo_surface_destroy(cache->overlay);
+	}
+	free(cache->text);
+	free(cache->layout_text);
+	memset(cache, 0, sizeof(struct swaylock_indicator_cache));
+}
+
+static cairo_surface_t *render_indicator_layer(struct swaylock_surface *surface,
+		const char *text, const char *layout_text, int buffer_width,
+		int buffer_height, int buffer_diameter, bool overlay) {
+	struct swaylock_indicator_cache *cache = &surface->indicator_cache;
+	cairo_surface_t *layer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+			buffer_width, buffer_height);
+	if (cairo_surface_status(layer) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(layer);
+		return NULL;
+	}
+	cairo_t *cairo = cairo_create(layer);
+	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
+	if (overlay) {
+		render_indicator_overlay(cairo, surface, buffer_width, buffer_diameter);
+	} else {
+		render_indicator_base(cairo, surface, text, layout_text,
+				buffer_width, buffer_diameter, cache);
+	}
+	cairo_destroy(cairo);
+	cairo_surface_flush(layer);
+	return layer;
+}
+
+static uint32_t indicator_serial = 0;
+
+/**
+ * Re-renders the cached layers if needed. If only the message or layout text
+ * changed, the boxes they occupied before and after are added to damage;
+ * returns false if anything else changed or the layers could not be rendered.
+ */
+static bool update_indicator_cache(struct swaylock_surface *surface,
+		const char *text, const char *layout_text, int buffer_width,
+		int buffer_height, int buffer_diameter, cairo_region_t *damage) {
+	struct swaylock_state *state = surface->state;
+	double scale = get_render_scale(surface);
+	struct swaylock_indicator_cache *cache = &surface->indicator_cache;
+	if (indicator_cache_matches(cache, surface, text, layout_text,
+			buffer_width, buffer_height)) {
+		return true;
+	}
+
+	bool text_only = cache->base &&
+		cache->auth_state == state->auth_state &&
+		cache->cleared == (state->input_state == INPUT_STATE_CLEAR) &&
+		cache->caps_lock == state->xkb.caps_lock &&
+		cache->scale == scale &&
+		cache->subpixel == surface->subpixel &&
+		cache->width == buffer_width && cache->height == buffer_height;
+	if (text_only) {
+		cairo_region_union_rectangle(damage, &cache->text_box);
+		cairo_region_union_rectangle(damage, &cache->layout_box);
+	}
+
+	destroy_indicator_cache(cache);
+	cache->base = render_indicator_layer(surface, text, layout_text,
+			buffer_width, buffer_height, buffer_diameter, false);
+	cache->overlay = render_indicator_layer(surface, text, layout_text,
+			buffer_width, buffer_height, buffer_diameter, true);
+	if (!cache->base || !cache->overlay) {
+		swaylock_log(LOG_ERROR, "Failed to render indicator cache");
+		destroy_indicator_cache(cache);
+		return false;
+	}
+
+	cache->auth_state = state->auth_state;
+	cache->cleared = state->input_state == INPUT_STATE_CLEAR;
+	cache->caps_lock = state->xkb.caps_lock;
+	cache->text = text ? strdup(text) : NULL;
+	cache->layout_text = layout_text ? strdup(layout_text) : NULL;
+	cache->scale = scale;
+	cache->subpixel = surface->subpixel;
+	cache->width = buffer_width;
+	cache->height = buffer_height;
+	if (++indicator_serial == 0) {
+		// 0 means a cleared buffer
+		++indicator_serial;
+	}
+	cache->serial = indicator_serial;
+
+	if (text_only) {
+		cairo_region_union_rectangle(damage, &cache->text_box);
+		cairo_region_union_rectangle(damage, &cache->layout_box);
+	}
+	return text_only;
 }
 
 void render_frame(struct swaylock_surface *surface) {
 	struct swaylock_state *state = surface->state;
+	double scale = get_render_scale(surface);
 
 	// First, compute the text that will be drawn, if any, since this
 	// determines the size/positioning of the surface
@@ -154,38 +1194,45 @@ void render_frame(struct swaylock_surface *surface) {
 	}
 
 	// Compute the size of the buffer needed
-	int arc_radius = state->args.radius * surface->scale;
-	int arc_thickness = state->args.thickness * surface->scale;
+	int arc_radius = state->args.radius * scale;
+	int arc_thickness = state->args.thickness * scale;
 	int buffer_diameter = (arc_radius + arc_thickness) * 2;
 	int buffer_width = buffer_diameter;
 	int buffer_height = buffer_diameter;
 
+	struct swaylock_font_cache *font = NULL;
 	if (text || layout_text) {
-		cairo_set_antialias(state->test_cairo, CAIRO_ANTIALIAS_BEST);
-		configure_font_drawing(state->test_cairo, state, surface->subpixel, arc_radius);
-
-		if (text) {
-			cairo_text_extents_t extents;
-			cairo_text_extents(state->test_cairo, text, &extents);
-			if (buffer_width < extents.width) {
-				buffer_width = extents.width;
+		font = get_font_cache(surface, arc_radius);
+	}
+	if (font) {
+		struct swaylock_text_run *run;
+		if (text && (run = get_text_run(font, text))) {
+			if (buffer_width < run->extents.width) {
+				buffer_width = run->extents.width;
 			}
 		}
-		if (layout_text) {
-			cairo_text_extents_t extents;
-			cairo_font_extents_t fe;
-			double box_padding = 4.0 * surface->scale;
-			cairo_text_extents(state->test_cairo, layout_text, &extents);
-			cairo_font_extents(state->test_cairo, &fe);
-			buffer_height += fe.height + 2 * box_padding;
-			if (buffer_width < extents.width + 2 * box_padding) {
-				buffer_width = extents.width + 2 * box_padding;
+		if (layout_text && (run = get_text_run(font, layout_text))) {
+			double box_padding = 4.0 * scale;
+			buffer_height += font->extents.height + 2 * box_padding;
+			if (buffer_width < run->extents.width + 2 * box_padding) {
+				buffer_width = run->extents.width + 2 * box_padding;
 			}
 		}
 	}
-	// Ensure buffer size is multiple of buffer scale - required by protocol
-	buffer_height += surface->scale - (buffer_height % surface->scale);
-	buffer_width += surface->scale - (buffer_width % surface->scale);
+	// Size of the subsurface, which the buffer must map to exactly
+	int logical_width, logical_height;
+	if (surface->fractional_scale) {
+		logical_width = ceil(buffer_width / scale);
+		logical_height = ceil(buffer_height / scale);
+		buffer_width = round(logical_width * scale);
+		buffer_height = round(logical_height * scale);
+	} else {
+		// Ensure buffer size is multiple of buffer scale - required by protocol
+		buffer_height += surface->scale - (buffer_height % surface->scale);
+		buffer_width += surface->scale - (buffer_width % surface->scale);
+		logical_width = buffer_width / surface->scale;
+		logical_height = buffer_height / surface->scale;
+	}
 
 	int subsurf_xpos;
 	int subsurf_ypos;
@@ -193,10 +1240,10 @@ void render_frame(struct swaylock_surface *surface) {
 	// Center the indicator unless overridden by the user
 	if (state->args.override_indicator_x_position) {
 		subsurf_xpos = state->args.indicator_x_position -
-			buffer_width / (2 * surface->scale) + 2 / surface->scale;
+			logical_width / 2 + (int)(2 / scale);
 	} else {
 		subsurf_xpos = surface->width / 2 -
-			buffer_width / (2 * surface->scale) + 2 / surface->scale;
+			logical_width / 2 + (int)(2 / scale);
 	}
 
 	if (state->args.override_indicator_y_position) {
@@ -207,9 +1254,22 @@ void render_frame(struct swaylock_surface *surface) {
 			(state->args.radius + state->args.thickness);
 	}
 
+	// Everything below works in the orientation as displayed, the buffer
+	// itself is in the output's
+	enum wl_output_transform transform = surface->transform;
+	bool transposed = is_transposed(transform);
 	struct pool_buffer *buffer = get_next_buffer(state->shm,
-			surface->indicator_buffers, buffer_width, buffer_height);
+			&surface->indicator_buffers,
+			transposed ? buffer_height : buffer_width,
+			transposed ? buffer_width : buffer_height);
 	if (buffer == NULL) {
+		// Every buffer is still held by the compositor; try again on the
+		// next frame rather than losing this update. The frame callback
+		// may already be requested, and only fires once it is committed.
+		swaylock_log(LOG_DEBUG, "No free indicator buffer for output %s",
+				surface->output_name ? surface->output_name : "?");
+		damage_surface(surface);
+		wl_surface_commit(surface->surface);
 		return;
 	}
 
@@ -217,139 +1277,132 @@ void render_frame(struct swaylock_surface *surface) {
 	cairo_t *cairo = buffer->cairo;
 	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
 
-	cairo_identity_matrix(cairo);
+	cairo_matrix_t matrix;
+	get_transform_matrix(&matrix, transform, buffer_width, buffer_height);
+	cairo_set_matrix(cairo, &matrix);
 
-	// Clear
-	cairo_save(cairo);
-	cairo_set_source_rgba(cairo, 0, 0, 0, 0);
-	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
-	cairo_paint(cairo);
-	cairo_restore(cairo);
-
-	float type_indicator_border_thickness =
-		TYPE_INDICATOR_BORDER_THICKNESS * surface->scale;
+	cairo_rectangle_int_t buffer_box = {0, 0, buffer_width, buffer_height};
+	cairo_region_t *damage = cairo_region_create();
+	bool full_damage = surface->indicator_width != buffer_width ||
+		surface->indicator_height != buffer_height;
 
+	// Serial of the cached layers shown in this frame, 0 if nothing is shown
+	uint32_t serial = 0;
+	cairo_rectangle_int_t overdraw = {0};
+	struct swaylock_indicator_cache *cache = &surface->indicator_cache;
 	if (draw_indicator) {
-		// Fill inner circle
-		cairo_set_line_width(cairo, 0);
-		cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
-				arc_radius - arc_thickness / 2, 0, 2 * M_PI);
-		set_color_for_state(cairo, state, &state->args.colors.inside);
-		cairo_fill_preserve(cairo);
-		cairo_stroke(cairo);
+		uint32_t prev_serial = cache->serial;
+		bool text_only = update_indicator_cache(surface, text, layout_text,
+				buffer_width, buffer_height, buffer_diameter, damage);
+		if (cache->base) {
+			serial = cache->serial;
+			if (serial != prev_serial && (!text_only ||
+					surface->indicator_serial != prev_serial)) {
+				full_damage = true;
+			}
+			if (state->input_state == INPUT_STATE_LETTER ||
+					state->input_state == INPUT_STATE_BACKSPACE) {
+				indicator_highlight_box(cairo, surface,
+						buffer_width, buffer_diameter, &overdraw);
+			}
+		}
+	}
+	if (serial == 0 && surface->indicator_serial != 0) {
+		full_damage = true;
+	}
 
-		// Draw ring
-		cairo_set_line_width(cairo, arc_thickness);
-		cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2, arc_radius,
-				0, 2 * M_PI);
-		set_color_for_state(cairo, state, &state->args.colors.ring);
-		cairo_stroke(cairo);
+	// Only repaint what differs from the content the buffer already holds
+	cairo_region_t *repaint;
+	if (buffer->serial == serial) {
+		repaint = cairo_region_create_rectangle(&buffer->overdraw);
+		cairo_region_union_rectangle(repaint, &overdraw);
+	} else {
+		repaint = cairo_region_create_rectangle(&buffer_box);
+	}
+	cairo_region_intersect_rectangle(repaint, &buffer_box);
 
-		// Draw a message
-		configure_font_drawing(cairo, state, surface->subpixel, arc_radius);
-		set_color_for_state(cairo, state, &state->args.colors.text);
-
-		if (text) {
-			cairo_text_extents_t extents;
-			cairo_font_extents_t fe;
-			double x, y;
-			cairo_text_extents(cairo, text, &extents);
-			cairo_font_extents(cairo, &fe);
-			x = (buffer_width / 2) -
-				(extents.width / 2 + extents.x_bearing);
-			y = (buffer_diameter / 2) +
-				(fe.height / 2 - fe.descent);
-
-			cairo_move_to(cairo, x, y);
-			cairo_show_text(cairo, text);
-			cairo_close_path(cairo);
-			cairo_new_sub_path(cairo);
+	if (!cairo_region_is_empty(repaint)) {
+		cairo_save(cairo);
+		for (int i = 0; i < cairo_region_num_rectangles(repaint); ++i) {
+			cairo_rectangle_int_t rect;
+			cairo_region_get_rectangle(repaint, i, &rect);
+			cairo_rectangle(cairo, rect.x, rect.y, rect.width, rect.height);
 		}
+		cairo_clip(cairo);
 
-		// Typing indicator: Highlight random part on keypress
-		if (state->input_state == INPUT_STATE_LETTER ||
-				state->input_state == INPUT_STATE_BACKSPACE) {
-			double highlight_start = state->highlight_start * (M_PI / 1024.0);
-			cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
-					arc_radius, highlight_start,
-					highlight_start + TYPE_INDICATOR_RANGE);
-			if (state->input_state == INPUT_STATE_LETTER) {
-				if (state->xkb.caps_lock && state->args.show_caps_lock_indicator) {
-					cairo_set_source_u32(cairo, state->args.colors.caps_lock_key_highlight);
-				} else {
-					cairo_set_source_u32(cairo, state->args.colors.key_highlight);
-				}
-			} else {
-				if (state->xkb.caps_lock && state->args.show_caps_lock_indicator) {
-					cairo_set_source_u32(cairo, state->args.colors.caps_lock_bs_highlight);
-				} else {
-					cairo_set_source_u32(cairo, state->args.colors.bs_highlight);
-				}
-			}
-			cairo_stroke(cairo);
-
-			// Draw borders
-			cairo_set_source_u32(cairo, state->args.colors.separator);
-			cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
-					arc_radius, highlight_start,
-					highlight_start + type_indicator_border_thickness);
-			cairo_stroke(cairo);
-
-			cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
-					arc_radius, highlight_start + TYPE_INDICATOR_RANGE,
-					highlight_start + TYPE_INDICATOR_RANGE +
-						type_indicator_border_thickness);
-			cairo_stroke(cairo);
-		}
+		if (serial != 0) {
+			// The base layer covers the whole buffer, so it also clears it
+			cairo_save(cairo);
+			cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+			cairo_set_source_surface(cairo, cache->base, 0, 0);
+			// Only ever rotated by right angles, which needs no filtering
+			cairo_pattern_set_filter(cairo_get_source(cairo),
+				CAIRO_FILTER_NEAREST);
+			cairo_paint(cairo);
+			cairo_restore(cairo);
 
-		// Draw inner + outer border of the circle
-		set_color_for_state(cairo, state, &state->args.colors.line);
-		cairo_set_line_width(cairo, 2.0 * surface->scale);
-		cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
-				arc_radius - arc_thickness / 2, 0, 2 * M_PI);
-		cairo_stroke(cairo);
-		cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
-				arc_radius + arc_thickness / 2, 0, 2 * M_PI);
-		cairo_stroke(cairo);
+			if (overdraw.width > 0) {
+				render_indicator_highlight(cairo, surface,
+						buffer_width, buffer_diameter);
+			}
 
-		// display layout text separately
-		if (layout_text) {
-			cairo_text_extents_t extents;
-			cairo_font_extents_t fe;
-			double x, y;
-			double box_padding = 4.0 * surface->scale;
-			cairo_text_extents(cairo, layout_text, &extents);
-			cairo_font_extents(cairo, &fe);
-			// upper left coordinates for box
-			x = (buffer_width / 2) - (extents.width / 2) - box_padding;
-			y = buffer_diameter;
-
-			// background box
-			cairo_rectangle(cairo, x, y,
-				extents.width + 2.0 * box_padding,
-				fe.height + 2.0 * box_padding);
-			cairo_set_source_u32(cairo, state->args.colors.layout_background);
-			cairo_fill_preserve(cairo);
-			// border
-			cairo_set_source_u32(cairo, state->args.colors.layout_border);
-			cairo_stroke(cairo);
-
-			// take font extents and padding into account
-			cairo_move_to(cairo,
-				x - extents.x_bearing + box_padding,
-				y + (fe.height - fe.descent) + box_padding);
-			cairo_set_source_u32(cairo, state->args.colors.layout_text);
-			cairo_show_text(cairo, layout_text);
-			cairo_new_sub_path(cairo);
+			cairo_set_source_surface(cairo, cache->overlay, 0, 0);
+			cairo_pattern_set_filter(cairo_get_source(cairo),
+				CAIRO_FILTER_NEAREST);
+			cairo_paint(cairo);
+		} else {
+			// Clear
+			cairo_set_source_rgba(cairo, 0, 0, 0, 0);
+			cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+			cairo_paint(cairo);
 		}
+		cairo_restore(cairo);
 	}
+	cairo_region_destroy(repaint);
+
+	if (full_damage) {
+		cairo_region_union_rectangle(damage, &buffer_box);
+	} else {
+		cairo_region_union_rectangle(damage, &surface->indicator_overdraw);
+		cairo_region_union_rectangle(damage, &overdraw);
+	}
+	cairo_region_intersect_rectangle(damage, &buffer_box);
+
+	buffer->serial = serial;
+	buffer->overdraw = overdraw;
+	surface->indicator_serial = serial;
+	surface->indicator_overdraw = overdraw;
+	surface->indicator_width = buffer_width;
+	surface->indicator_height = buffer_height;
 
 	// Send Wayland requests
 	wl_subsurface_set_position(surface->subsurface, subsurf_xpos, subsurf_ypos);
+	if (full_damage) {
+		set_indicator_opaque_region(surface, serial != 0, buffer_width,
+			buffer_diameter);
+	}
 
-	wl_surface_set_buffer_scale(surface->child, surface->scale);
+	if (surface->fractional_scale) {
+		wl_surface_set_buffer_scale(surface->child, 1);
+		set_viewport_destination(surface->child_viewport,
+			&surface->child_viewport_width, &surface->child_viewport_height,
+			logical_width, logical_height);
+	} else {
+		wl_surface_set_buffer_scale(surface->child, surface->scale);
+		set_viewport_destination(surface->child_viewport,
+			&surface->child_viewport_width, &surface->child_viewport_height,
+			0, 0);
+	}
+	wl_surface_set_buffer_transform(surface->child, transform);
 	wl_surface_attach(surface->child, buffer->buffer, 0, 0);
-	wl_surface_damage_buffer(surface->child, 0, 0, INT32_MAX, INT32_MAX);
+	for (int i = 0; i < cairo_region_num_rectangles(damage); ++i) {
+		cairo_rectangle_int_t rect;
+		cairo_region_get_rectangle(damage, i, &rect);
+		rect = transform_rect(&matrix, &rect);
+		wl_surface_damage_buffer(surface->child,
+				rect.x, rect.y, rect.width, rect.height);
+	}
+	cairo_region_destroy(damage);
 	wl_surface_commit(surface->child);
 
 	wl_surface_commit(surface->surface);
@@ -0,0 +1,75 @@
+// Checks the vector pixel conversion kernels against the scalar ones, over
+// every color/alpha pair and over row widths that exercise the tails
+#include <stdio.h>
+#include <stdlib.h>
+#include "../pixel-convert.c"
+
+#define MAX_WIDTH 40
+#define NUM_PIXELS (256 * 256)
+
+typedef void (*row_fn)(uint32_t *dst, const uint8_t *src, int width);
+
+// Converts the pixels in rows of every width up to MAX_WIDTH
+static int check(const char *name, row_fn fn, row_fn ref,
+		const uint8_t *src, int channels) {
+	static uint32_t out[MAX_WIDTH], expected[MAX_WIDTH];
+	int failures = 0;
+	for (int width = 1; width <= MAX_WIDTH; ++width) {
+		for (int i = 0; i + width <= NUM_PIXELS; i += width) {
+			const uint8_t *row = src + (size_t)i * channels;
+			fn(out, row, width);
+			ref(expected, row, width);
+			for (int x = 0; x < width; ++x) {
+				if (out[x] != expected[x] && ++failures <= 10) {
+					fprintf(stderr, "%s: width %d, pixel %d: "
+							"got %08x, expected %08x\n", name, width,
+							i + x, out[x], expected[x]);
+				}
+			}
+		}
+	}
+	printf("%s: %s\n", name, failures ? "FAIL" : "ok");
+	return failures;
+}
+
+int main(void) {
+	// Every value of each color channel meets every alpha value
+	static uint8_t rgba[NUM_PIXELS * 4], rgb[NUM_PIXELS * 3];
+	for (int i = 0; i < NUM_PIXELS; ++i) {
+		int c = i & 0xff, a = i >> 8;
+		uint8_t color[] = {c, (c + 85) & 0xff, (c + 170) & 0xff};
+		for (int k = 0; k < 3; ++k) {
+			rgba[i * 4 + k] = color[k];
+			rgb[i * 3 + k] = color[(k + a) % 3];
+		}
+		rgba[i * 4 + 3] = a;
+	}
+
+	int failures = 0;
+	int checked = 0;
+#ifdef PIXEL_CONVERT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		failures += check("rgba_row_sse2", rgba_row_sse2, rgba_row_scalar,
+			rgba, 4);
+		++checked;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		failures += check("rgba_row_avx2", rgba_row_avx2, rgba_row_scalar,
+			rgba, 4);
+		failures += check("rgb_row_avx2", rgb_row_avx2, rgb_row_scalar,
+			rgb, 3);
+		++checked;
+	}
+#elif defined(PIXEL_CONVERT_NEON)
+	failures += check("rgba_row_neon", rgba_row_neon, rgba_row_scalar,
+		rgba, 4);
+	failures += check("rgb_row_neon", rgb_row_neon, rgb_row_scalar, rgb, 3);
+	++checked;
+#endif
+	if (!checked) {
+		printf("No vector kernels to check on this CPU\n");
+		return 77; // skipped
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}